@@ -28,16 +28,32 @@ References:
 #define TDC_TRIE_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
 
 #include <boost/endian.hpp>
+#include <utf8.h>
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+	#include <unistd.h>
+#endif
+#include <cerrno>
+#include <clocale>
 #include <cstdio>
 #include <cstring>
+#include <cwctype>
 #include <stdint.h>
 #include <map>
+#include <unordered_set>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <limits>
 #include <stdexcept>
+#include <thread>
+#include <iterator>
+#include <type_traits>
 
 namespace tdc {
 
@@ -46,7 +62,7 @@ const uint32_t TRIE_VERSION_MAJOR = 0;
 const uint32_t TRIE_VERSION_MINOR = 8;
 const uint32_t TRIE_VERSION_PATCH = 2;
 const uint32_t TRIE_REVISION = 10545;
-const uint32_t TRIE_SERIALIZED_REVISION = 10498;
+const uint32_t TRIE_SERIALIZED_REVISION = 10555;
 
 typedef std::basic_string<uint8_t> u8string;
 typedef std::basic_string<uint16_t> u16string;
@@ -66,6 +82,10 @@ inline char *char_p(T t) {
 	return reinterpret_cast<char*>(t);
 }
 
+inline uint8_t bswap(uint8_t v) {
+	return v;
+}
+
 #ifdef BOOST_BIG_ENDIAN
 inline uint32_t bswap(uint32_t v) {
 	return (v >> 24) | ((v & 0x00FF0000) >> 8) | ((v & 0x0000FF00) << 8) | (v << 24);
@@ -73,6 +93,9 @@ inline uint32_t bswap(uint32_t v) {
 inline uint16_t bswap(uint16_t v) {
 	return (v >> 8) | (v << 8);
 }
+inline uint64_t bswap(uint64_t v) {
+	return (static_cast<uint64_t>(bswap(static_cast<uint32_t>(v))) << 32) | bswap(static_cast<uint32_t>(v >> 32));
+}
 #else
 inline uint32_t bswap(uint32_t v) {
 	return v;
@@ -80,7 +103,33 @@ inline uint32_t bswap(uint32_t v) {
 inline uint16_t bswap(uint16_t v) {
 	return v;
 }
+inline uint64_t bswap(uint64_t v) {
+	return v;
+}
+#endif
+
+inline unsigned popcount64(uint64_t v) {
+#ifdef _MSC_VER
+	return static_cast<unsigned>(__popcnt64(v));
+#else
+	return static_cast<unsigned>(__builtin_popcountll(v));
 #endif
+}
+
+// The system's page size, asked for once; platforms without sysconf() get 4 KiB
+inline size_t page_size() {
+	static const size_t page = [] {
+		size_t n = 4096;
+#if defined(__unix__) || defined(__APPLE__)
+		long r = sysconf(_SC_PAGESIZE);
+		if (r > 0) {
+			n = static_cast<size_t>(r);
+		}
+#endif
+		return n;
+	}();
+	return page;
+}
 
 template<typename T>
 inline void write(std::ostream& out, T v) {
@@ -102,6 +151,13 @@ inline T read(std::istream& in) {
 	return v;
 }
 
+template<typename T>
+inline char *write(char *out, T v) {
+	v = bswap(v);
+	memcpy(out, &v, sizeof(v));
+	return out + sizeof(v);
+}
+
 template<typename T>
 inline void read(const char *in, T& v) {
 	memcpy(&v, in, sizeof(v));
@@ -116,6 +172,309 @@ inline T read(const char *in) {
 	return v;
 }
 
+// Whether the file starts with the given 4 byte magic, so tools can pick the reader that matches a file
+inline bool has_magic(const char *fname, const char *magic) {
+	char buf[4] = {};
+	std::ifstream in(fname, std::ios::binary);
+	in.read(buf, sizeof(buf));
+	return in.gcount() == sizeof(buf) && memcmp(buf, magic, 4) == 0;
+}
+
+inline bool has_magic(const char *p, size_t n, const char *magic) {
+	return n >= 4 && memcmp(p, magic, 4) == 0;
+}
+
+// Code unit width stored in a serialized trie of any layout, or 0 if the file is too short; every header has it right after the magic and revision
+inline uint16_t code_unit_width(const char *fname) {
+	char buf[10] = {};
+	std::ifstream in(fname, std::ios::binary);
+	in.read(buf, sizeof(buf));
+	return (in.gcount() == sizeof(buf)) ? read<uint16_t>(buf + 8) : 0;
+}
+
+inline uint16_t code_unit_width(const char *p, size_t n) {
+	return (n >= 10) ? read<uint16_t>(p + 8) : 0;
+}
+
+// Appends the UTF-8 in [b,e) to out as code units; UTF-16 strings are transcoded, while byte strings take the UTF-8 as it is
+template<typename It>
+inline void from_utf8(It b, It e, u16string& out) {
+	utf8::utf8to16(b, e, std::back_inserter(out));
+}
+
+template<typename It>
+inline void from_utf8(It b, It e, u8string& out) {
+	out.append(b, e);
+}
+
+template<typename It, typename Out>
+inline Out to_utf8(It b, It e, Out out, std::false_type) {
+	return utf8::utf16to8(b, e, out);
+}
+
+template<typename It, typename Out>
+inline Out to_utf8(It b, It e, Out out, std::true_type) {
+	for (; b != e; ++b) {
+		*out++ = static_cast<char>(*b);
+	}
+	return out;
+}
+
+// Writes the code units in [b,e) to out as UTF-8, the inverse of from_utf8()
+template<typename It, typename Out>
+inline Out to_utf8(It b, It e, Out out) {
+	return to_utf8(b, e, out, std::integral_constant<bool, sizeof(typename std::iterator_traits<It>::value_type) == 1>());
+}
+
+// Reads the next line of a query log: one UTF-8 word per line, optionally followed by a tab and how many times it was queried.
+// Lines without a count count once. A count that is not a number, or is above 2^32-1 so that summing the counts could overflow, is reported on
+// std::cerr with its line number and reads as 0, so callers skip the line like any other 0 count.
+inline bool read_query(std::istream& in, std::string& word8, size_t& count, size_t& lineno) {
+	if (!std::getline(in, word8)) {
+		return false;
+	}
+	++lineno;
+	while (!word8.empty() && (word8.back() == '\r' || word8.back() == '\n')) {
+		word8.pop_back();
+	}
+	count = 1;
+	size_t tab = word8.find('\t');
+	if (tab != std::string::npos) {
+		if (tab + 1 == word8.size() || word8.find_first_not_of("0123456789", tab + 1) != std::string::npos) {
+			std::cerr << "Line " << lineno << ": count '" << word8.substr(tab + 1) << "' is not a number, skipping the line" << std::endl;
+			count = 0;
+		}
+		else {
+			errno = 0;
+			unsigned long long n = std::strtoull(word8.c_str() + tab + 1, 0, 10);
+			count = static_cast<size_t>(n);
+			if (errno == ERANGE || n > std::numeric_limits<uint32_t>::max()) {
+				std::cerr << "Line " << lineno << ": count " << word8.substr(tab + 1) << " is too large, skipping the line" << std::endl;
+				count = 0;
+			}
+		}
+		word8.resize(tab);
+	}
+	return true;
+}
+
+// Wide character classes only make sense for whole code points, so the bytes of a multibyte UTF-8 sequence never match and are never folded
+template<typename C>
+inline bool unit_isspace(C c) {
+	return (sizeof(C) > 1 || c < 0x80) && std::iswspace(c);
+}
+
+template<typename C>
+inline bool unit_ispunct(C c) {
+	return (sizeof(C) > 1 || c < 0x80) && std::iswpunct(c);
+}
+
+template<typename C>
+inline C unit_tolower(C c) {
+	return (sizeof(C) > 1 || c < 0x80) ? static_cast<C>(std::towlower(c)) : c;
+}
+
+// Appends in folded to lower case to out. towlower() follows LC_CTYPE, so only ASCII folds unless the program picked a Unicode locale.
+inline void fold_lower(const u16string& in, u16string& out) {
+	std::transform(in.begin(), in.end(), std::back_inserter(out), unit_tolower<u16string::value_type>);
+}
+
+// UTF-8 is folded a code point at a time, so letters such as Ø fold too; bytes that are not valid UTF-8 are folded one by one as unit_tolower() does
+inline void fold_lower(const u8string& in, u8string& out) {
+	if (!utf8::is_valid(in.begin(), in.end())) {
+		std::transform(in.begin(), in.end(), std::back_inserter(out), unit_tolower<u8string::value_type>);
+		return;
+	}
+	for (auto it = in.begin(); it != in.end();) {
+		uint32_t cp = utf8::unchecked::next(it);
+		utf8::unchecked::append(static_cast<uint32_t>(std::towlower(static_cast<wint_t>(cp))), std::back_inserter(out));
+	}
+}
+
+// Picks a locale in which fold_lower() folds all of Unicode, since towlower() only folds ASCII in the default C locale.
+// C.UTF-8 folds the same on every system that has it; elsewhere this falls back to the user's locale.
+inline void use_unicode_ctype() {
+	if (!std::setlocale(LC_CTYPE, "C.UTF-8")) {
+		std::setlocale(LC_CTYPE, "");
+	}
+}
+
+// Bytes taken by c labels of the given width, padded so whatever follows them stays 4 byte aligned
+inline size_t labels_size(size_t c, size_t width) {
+	return (c*width + 3) & ~static_cast<size_t>(3);
+}
+
+// FNV-1a over the serialized sections, so a reader can check a file without walking its structure
+inline uint32_t checksum(const char *p, size_t n) {
+	uint32_t rv = 2166136261u;
+	for (size_t i = 0; i < n; ++i) {
+		rv ^= static_cast<uint8_t>(p[i]);
+		rv *= 16777619u;
+	}
+	return rv;
+}
+
+/*
+Serialized layout; all fields are little-endian:
+	"TRIE" magic
+	uint32_t revision
+	uint16_t code unit width, 2 for UTF-16 or 1 for UTF-8
+	uint16_t flags, 0x0001 if compressed | 0x0002 if weighted | 0x0004 if words have values
+	Count    number of nodes
+	Count    offset of the symbol table
+	Count    number of symbols, which is 0 if labels are stored as code units
+	Count    offset of the values
+	Count    size of the values, which is 0 if words have no values
+	Count    offset of the node records
+	Count    size of the node records
+	Count    offset of the node index
+	Count    size of the node index, which is 0 if there is no index
+	uint32_t checksum() of everything from the symbol table to the end of the index
+Followed by the symbol table, the values, the node records and then the optional index of each node's record offset.
+The symbol table is the uint16_t code unit of each symbol, padded to a multiple of 4 bytes. If there is one, every label in the node records is a
+symbol id, which is the 1-based position of its code unit in the table, and the table is ordered by descending edge frequency.
+The values are a Count of values and then each distinct value as a Count of bytes followed by the bytes, padded to a multiple of 4 bytes.
+A node record is uint16_t label, uint16_t flags, Count num_terminals, an optional chain, Count number of children, then the label of each child as a
+code unit of the stored width, or a uint8_t symbol id, padded to a multiple of 4 bytes, and then the file offset of each child's record.
+Flags are 0x8000 | 0x0002 if there is a chain | 0x0001 if terminal. A chain holds a run of non-terminal nodes that each have a single parent,
+and that hang below the record's node one after the other; it is a uint16_t label and uint16_t number of chain entries left for each, followed by
+Count num_terminals of the chained nodes. The children are then those of the last chained node. A chained node's offset is that of its chain entry,
+which can be told apart from a record since the count of entries left never has the 0x8000 bit set.
+In a weighted trie the Count of terminals right before the number of children is followed by Count weight of the record's word, 0 if it is not
+terminal, and Count largest weight of any word below the last chained node, or below the node itself if there is no chain. Chained nodes are never
+terminal, so the largest weight in any node's subtree can be had from the record it is in.
+If words have values, a Count file offset of the value of the record's word comes next, which is 0 if the node is not terminal or has no value.
+*/
+struct trie_header {
+	uint32_t revision;
+	uint16_t width;
+	uint16_t flags;
+	uint32_t num_nodes;
+	uint32_t symbols_offset;
+	uint32_t num_symbols;
+	uint32_t values_offset;
+	uint32_t values_size;
+	uint32_t nodes_offset;
+	uint32_t nodes_size;
+	uint32_t index_offset;
+	uint32_t index_size;
+	uint32_t checksum;
+
+	// The magic and then every field in the order write() stores them, so the two can not disagree
+	static size_t size() {
+		return 4 + sizeof(revision) + sizeof(width) + sizeof(flags) + sizeof(num_nodes) + sizeof(symbols_offset) + sizeof(num_symbols)
+			+ sizeof(values_offset) + sizeof(values_size) + sizeof(nodes_offset) + sizeof(nodes_size) + sizeof(index_offset) + sizeof(index_size) + sizeof(checksum);
+	}
+
+	char *write(char *p) const {
+		memcpy(p, "TRIE", 4);
+		p += 4;
+		p = ::tdc::write(p, revision);
+		p = ::tdc::write(p, width);
+		p = ::tdc::write(p, flags);
+		p = ::tdc::write(p, num_nodes);
+		p = ::tdc::write(p, symbols_offset);
+		p = ::tdc::write(p, num_symbols);
+		p = ::tdc::write(p, values_offset);
+		p = ::tdc::write(p, values_size);
+		p = ::tdc::write(p, nodes_offset);
+		p = ::tdc::write(p, nodes_size);
+		p = ::tdc::write(p, index_offset);
+		p = ::tdc::write(p, index_size);
+		p = ::tdc::write(p, checksum);
+		return p;
+	}
+
+	// Parses and validates a header from the first n bytes of p, throwing on anything that does not fit
+	void read(const char *p, size_t n, uint16_t expect_width) {
+		if (n < size() || memcmp(p, "TRIE", 4)) {
+			throw std::runtime_error("Unserialize stream did not start with magic byte sequence TRIE");
+		}
+		p += 4;
+		::tdc::read(p, revision);
+		p += sizeof(revision);
+		if (revision != TRIE_SERIALIZED_REVISION) {
+			char _msg[] = "Unserialize expected revision %u but data had revision %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, TRIE_SERIALIZED_REVISION, revision));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, width);
+		p += sizeof(width);
+		if (width != expect_width) {
+			char _msg[] = "Unserialize expected code unit width %u but data had width %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, expect_width, width));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, flags);
+		p += sizeof(flags);
+		::tdc::read(p, num_nodes);
+		p += sizeof(num_nodes);
+		::tdc::read(p, symbols_offset);
+		p += sizeof(symbols_offset);
+		::tdc::read(p, num_symbols);
+		p += sizeof(num_symbols);
+		::tdc::read(p, values_offset);
+		p += sizeof(values_offset);
+		::tdc::read(p, values_size);
+		p += sizeof(values_size);
+		::tdc::read(p, nodes_offset);
+		p += sizeof(nodes_offset);
+		::tdc::read(p, nodes_size);
+		p += sizeof(nodes_size);
+		::tdc::read(p, index_offset);
+		p += sizeof(index_offset);
+		::tdc::read(p, index_size);
+		p += sizeof(index_size);
+		::tdc::read(p, checksum);
+
+		if (num_symbols > 255 || symbols_offset < size() || static_cast<size_t>(symbols_offset) + labels_size(num_symbols, sizeof(uint16_t)) > values_offset
+			|| static_cast<size_t>(values_offset) + values_size > nodes_offset || static_cast<size_t>(nodes_offset) + nodes_size > index_offset
+			|| (index_size != 0 && index_size != static_cast<uint64_t>(num_nodes) * sizeof(uint32_t)) || static_cast<size_t>(index_offset) + index_size > n) {
+			throw std::runtime_error("Unserialize found section sizes that do not match the data; the file is truncated or corrupt");
+		}
+	}
+};
+
+// Knobs for trie::serialize(); the defaults produce what every reader understands
+struct serialize_options {
+	// Order of the node records in the file. Readers only follow offsets, so any order reads the same, but lookups touch fewer
+	// cache lines and pages when records that are visited together are stored together.
+	enum layout_type {
+		// The order nodes were created in by add() and compress(), which scatters a node's children across the file
+		layout_creation,
+		// Level by level from the root, so the top of the trie is dense
+		layout_bfs,
+		// Depth first in label order, so each child follows its parent and a subtree is contiguous up to shared suffixes
+		layout_dfs,
+		// Page sized clusters, each filled level by level from its own root and placed depth first, in the spirit of a van Emde Boas layout.
+		// A lookup then touches about one page per cluster height instead of one per node.
+		layout_clustered,
+		// The nodes in heat, hottest first, and then the cold rest as layout_clustered; see trie::count_visits()
+		layout_profile,
+	};
+
+	size_t jobs;
+	// Whether to write the trailing index of node record offsets. Readers do not need it since children point directly at records.
+	bool index;
+	// Whether to fold runs of single child nodes into chains in the record above them, see trie_header
+	bool path_compress;
+	// Whether to store labels as 8 bit ids into a frequency ordered symbol table, see trie_header. Ignored if there are more than 255 distinct labels.
+	bool alphabet;
+	layout_type layout;
+	// Visit counts by node number for layout_profile
+	std::vector<size_t> heat;
+
+	serialize_options() :
+		jobs(1),
+		index(true),
+		path_compress(false),
+		alphabet(false),
+		layout(layout_creation) {
+	}
+};
+
 template<typename T, typename Y>
 inline typename T::iterator lower_bound(T& t, const Y& y) {
 	typename T::iterator it, first = t.begin();
@@ -176,160 +535,1071 @@ inline typename T::iterator insertchild(T& t, Y&& y) {
 		if (it->first == y.first) {
 			return it;
 		}
-		if (it->first > y.first) {
-			break;
+		if (it->first > y.first) {
+			break;
+		}
+	}
+	return t.insert(it, std::move(y));
+}
+
+/*
+Bit masks of where a word has each of its units, for the bit-parallel edit distance searches below: bit i+offset of a unit's mask is set if
+the word has that unit at position i. Each mask is words uint64_t long, and units not in the word share a last mask that is all zero.
+*/
+template<typename String>
+class unit_masks {
+public:
+	typedef typename String::value_type unit_type;
+
+	unit_masks(const String& word, size_t words, size_t offset) :
+		words(words)
+	{
+		for (auto c : word) {
+			if (std::find(units.begin(), units.end(), c) == units.end()) {
+				units.push_back(c);
+			}
+		}
+		masks.assign((units.size() + 1) * words, 0);
+		for (size_t i = 0 ; i < word.size() ; ++i) {
+			size_t u = std::find(units.begin(), units.end(), word[i]) - units.begin();
+			masks[u * words + (i + offset) / 64] |= uint64_t(1) << ((i + offset) % 64);
+		}
+	}
+
+	const uint64_t *of(unit_type c) const {
+		size_t u = std::find(units.begin(), units.end(), c) - units.begin();
+		return &masks[u * words];
+	}
+
+private:
+	size_t words;
+	std::vector<unit_type> units;
+	std::vector<uint64_t> masks;
+};
+
+/*
+Levenshtein automaton for one query word, run bit-parallel as in Wu and Manber's agrep. A state holds a bit set per edit count e, with bit i set
+if the labels fed so far can be turned into the first i units of the word with at most e edits. Feeding a label is a handful of word operations
+per edit count, so a query walks it down the trie with one state per depth, and drops a branch as soon as no prefix of the word is within maxdist.
+*/
+template<typename String>
+class levenshtein_automaton {
+public:
+	typedef typename String::value_type unit_type;
+
+	levenshtein_automaton(const String& word, size_t maxdist) :
+		length(word.size()),
+		maxdist(maxdist),
+		words(word.size() / 64 + 1),
+		masks(word, words, 1)
+	{
+		// Bits past the end of the word would otherwise shift in from below and look like reachable positions
+		used.assign(words, ~uint64_t(0));
+		if ((length + 1) % 64) {
+			used.back() = (uint64_t(1) << ((length + 1) % 64)) - 1;
+		}
+	}
+
+	// Number of uint64_t a state takes
+	size_t state_size() const {
+		return (maxdist + 1) * words;
+	}
+
+	// With nothing fed yet, the first e units of the word are reachable with e deletions
+	void start(uint64_t *s) const {
+		std::fill(s, s + state_size(), 0);
+		for (size_t e = 0 ; e <= maxdist ; ++e) {
+			for (size_t i = 0 ; i <= std::min(e, length) ; ++i) {
+				s[e * words + i / 64] |= uint64_t(1) << (i % 64);
+			}
+		}
+	}
+
+	// Writes the state after feeding c to to, and returns whether any position is still reachable within maxdist
+	bool step(const uint64_t *from, uint64_t *to, unit_type c) const {
+		const uint64_t *b = masks.of(c);
+		for (size_t e = 0 ; e <= maxdist ; ++e) {
+			const uint64_t *r = from + e * words;
+			uint64_t *o = to + e * words;
+			uint64_t rc = 0, pc = 0, nc = 0;
+			for (size_t j = 0 ; j < words ; ++j) {
+				// Match: advance one position on an equal unit
+				uint64_t v = ((r[j] << 1) | rc) & b[j];
+				rc = r[j] >> 63;
+				if (e) {
+					const uint64_t *pr = r - words, *pn = o - words;
+					// Insertion stays put, substitution advances, and deletion advances again after this step, each for one more edit
+					v |= pr[j] | (pr[j] << 1) | pc | (pn[j] << 1) | nc;
+					pc = pr[j] >> 63;
+					nc = pn[j] >> 63;
+				}
+				o[j] = v & used[j];
+			}
+		}
+		const uint64_t *last = to + maxdist * words;
+		for (size_t j = 0 ; j < words ; ++j) {
+			if (last[j]) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Edit distance between the labels fed so far and the whole word, or maxdist+1 if it is larger than maxdist
+	size_t distance(const uint64_t *s) const {
+		for (size_t e = 0 ; e <= maxdist ; ++e) {
+			if (s[e * words + length / 64] & (uint64_t(1) << (length % 64))) {
+				return e;
+			}
+		}
+		return maxdist + 1;
+	}
+
+private:
+	size_t length;
+	size_t maxdist;
+	size_t words;
+	// Bit i+1 is position i, since bit 0 stands for the empty prefix
+	unit_masks<String> masks;
+	std::vector<uint64_t> used;
+};
+
+/*
+Edit distance DP for one query word, as one row per depth of the trie walk. Row d holds the distance from the first d labels to each prefix
+of the word, stored as Myers' bit vectors of where the row steps up or down by 1, and advanced with Hyyrö's whole-word variant of his update,
+so a step is a few word operations per 64 units of the word. It has the interface of levenshtein_automaton, and is what trie_mmap::query_rows() walks.
+*/
+template<typename String>
+class levenshtein_rows {
+public:
+	typedef typename String::value_type unit_type;
+
+	levenshtein_rows(const String& word, size_t maxdist) :
+		length(word.size()),
+		maxdist(maxdist),
+		words((word.size() + 63) / 64),
+		masks(word, words, 0)
+	{
+	}
+
+	// Number of uint64_t a row takes: the up and down steps, then the distance to the whole word and the depth
+	size_t state_size() const {
+		return 2 * words + 2;
+	}
+
+	// From the empty path the distance to each prefix of the word is its length, so every step is up
+	void start(uint64_t *s) const {
+		std::fill(s, s + words, ~uint64_t(0));
+		std::fill(s + words, s + 2 * words, 0);
+		s[2 * words] = length;
+		s[2 * words + 1] = 0;
+	}
+
+	// Writes the row after feeding c to to, and returns whether any prefix of the word is still within maxdist
+	bool step(const uint64_t *from, uint64_t *to, unit_type c) const {
+		const uint64_t *eqs = masks.of(c);
+		const uint64_t *pv = from, *mv = from + words;
+		// The distance to the empty prefix is the depth, so the row's first cell rises by 1 per label
+		int hin = 1;
+		for (size_t j = 0 ; j < words ; ++j) {
+			uint64_t eq = eqs[j];
+			uint64_t xv = eq | mv[j];
+			if (hin < 0) {
+				eq |= 1;
+			}
+			uint64_t xh = (((eq & pv[j]) + pv[j]) ^ pv[j]) | eq;
+			uint64_t ph = mv[j] | ~(xh | pv[j]);
+			uint64_t mh = pv[j] & xh;
+			// How the last cell of this block changed, which is what the next block starts from
+			uint64_t last = uint64_t(1) << ((j + 1 < words) ? 63 : (length - 1) % 64);
+			int hout = (ph & last) ? 1 : ((mh & last) ? -1 : 0);
+			ph <<= 1;
+			mh <<= 1;
+			if (hin < 0) {
+				mh |= 1;
+			}
+			else if (hin > 0) {
+				ph |= 1;
+			}
+			to[j] = mh | ~(xv | ph);
+			to[words + j] = ph & xv;
+			hin = hout;
+		}
+		to[2 * words] = static_cast<uint64_t>(static_cast<int64_t>(from[2 * words]) + hin);
+		to[2 * words + 1] = from[2 * words + 1] + 1;
+		return within(to);
+	}
+
+	// Edit distance between the labels fed so far and the whole word, or maxdist+1 if it is larger than maxdist
+	size_t distance(const uint64_t *s) const {
+		return (s[2 * words] <= maxdist) ? static_cast<size_t>(s[2 * words]) : maxdist + 1;
+	}
+
+private:
+	size_t length;
+	size_t maxdist;
+	size_t words;
+	unit_masks<String> masks;
+
+	// Whether some cell of the row is at most maxdist. The distance to a prefix of length i is at least |d - i| at depth d, so only the cells
+	// that close to the depth are read: the first one is summed from the steps above it, and the rest are walked to.
+	bool within(const uint64_t *s) const {
+		const uint64_t *pv = s, *mv = s + words;
+		size_t d = static_cast<size_t>(s[2 * words + 1]);
+		size_t lo = (d > maxdist) ? d - maxdist : 0;
+		if (lo > length) {
+			return false;
+		}
+		size_t hi = std::min(length, d + maxdist);
+		int64_t v = static_cast<int64_t>(d);
+		for (size_t j = 0 ; j < lo / 64 ; ++j) {
+			v += static_cast<int64_t>(popcount64(pv[j])) - popcount64(mv[j]);
+		}
+		if (lo % 64) {
+			uint64_t below = (uint64_t(1) << (lo % 64)) - 1;
+			v += static_cast<int64_t>(popcount64(pv[lo / 64] & below)) - popcount64(mv[lo / 64] & below);
+		}
+		for (size_t i = lo ; ; ++i) {
+			if (v <= static_cast<int64_t>(maxdist)) {
+				return true;
+			}
+			if (i == hi) {
+				return false;
+			}
+			v += static_cast<int64_t>((pv[i / 64] >> (i % 64)) & 1) - static_cast<int64_t>((mv[i / 64] >> (i % 64)) & 1);
+		}
+	}
+};
+
+/*
+Sets up a walk for the words within maxdist edits of word, with Search being levenshtein_automaton or levenshtein_rows, and calls
+walk(search, states, path) for a reader to feed its labels from the root: states holds the start state and has room for one state per depth,
+and path is an empty buffer for the labels walked. An empty word matches nothing, so walk is not called for it.
+*/
+template<typename Search, typename String, typename Walk>
+inline void search_within(const String& word, size_t maxdist, Walk&& walk) {
+	if (word.empty()) {
+		return;
+	}
+	// No path longer than the word plus maxdist can match, and the last step writes one state past that
+	Search la(word, maxdist);
+	std::vector<uint64_t> states(la.state_size() * (word.size() + maxdist + 2));
+	la.start(states.data());
+	String path;
+	path.reserve(word.size() + maxdist + 1);
+	walk(la, states.data(), path);
+}
+
+/*
+Child list storage for trie nodes. Holds a single element inline, which covers most nodes of a DAWG, and spills to the heap beyond that.
+A list can also be a view into storage owned by someone else, which is how a frozen trie keeps all children in one contiguous array.
+Views are never written through in size; any growth turns a view back into owned storage.
+*/
+template<typename T>
+class small_vector {
+private:
+	uint32_t size_;
+	uint32_t cap_; // 0 = view into external storage, 1 = inline, >1 = heap
+	union {
+		T one_;
+		T *ptr_;
+	};
+
+	void release() {
+		if (cap_ > 1) {
+			delete[] ptr_;
+		}
+	}
+
+	void grow(uint32_t cap) {
+		T *np = new T[cap];
+		std::copy(begin(), end(), np);
+		release();
+		ptr_ = np;
+		cap_ = cap;
+	}
+
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	small_vector() :
+		size_(0),
+		cap_(1),
+		one_() {
+	}
+
+	small_vector(const small_vector& o) :
+		size_(0),
+		cap_(1),
+		one_() {
+		*this = o;
+	}
+
+	small_vector(small_vector&& o) noexcept :
+		size_(o.size_),
+		cap_(o.cap_),
+		one_() {
+		if (cap_ == 1) {
+			one_ = o.one_;
+		}
+		else {
+			ptr_ = o.ptr_;
+		}
+		o.size_ = 0;
+		o.cap_ = 1;
+		o.one_ = T();
+	}
+
+	~small_vector() {
+		release();
+	}
+
+	small_vector& operator=(const small_vector& o) {
+		if (this != &o) {
+			clear();
+			reserve(o.size_);
+			std::copy(o.begin(), o.end(), begin());
+			size_ = o.size_;
+		}
+		return *this;
+	}
+
+	small_vector& operator=(small_vector&& o) noexcept {
+		if (this != &o) {
+			release();
+			size_ = o.size_;
+			cap_ = o.cap_;
+			if (cap_ == 1) {
+				one_ = o.one_;
+			}
+			else {
+				ptr_ = o.ptr_;
+			}
+			o.size_ = 0;
+			o.cap_ = 1;
+			o.one_ = T();
+		}
+		return *this;
+	}
+
+	// Drops owned storage and becomes a read-mostly view of n elements at p
+	void view(T *p, size_t n) {
+		release();
+		ptr_ = p;
+		size_ = static_cast<uint32_t>(n);
+		cap_ = 0;
+	}
+
+	T *data() {
+		return cap_ == 1 ? &one_ : ptr_;
+	}
+
+	const T *data() const {
+		return cap_ == 1 ? &one_ : ptr_;
+	}
+
+	iterator begin() {
+		return data();
+	}
+
+	iterator end() {
+		return data() + size_;
+	}
+
+	const_iterator begin() const {
+		return data();
+	}
+
+	const_iterator end() const {
+		return data() + size_;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return size_ == 0;
+	}
+
+	T& operator[](size_t i) {
+		return data()[i];
+	}
+
+	const T& operator[](size_t i) const {
+		return data()[i];
+	}
+
+	T& front() {
+		return data()[0];
+	}
+
+	const T& front() const {
+		return data()[0];
+	}
+
+	T& back() {
+		return data()[size_ - 1];
+	}
+
+	const T& back() const {
+		return data()[size_ - 1];
+	}
+
+	void reserve(size_t n) {
+		n = std::max(n, static_cast<size_t>(size_));
+		if (cap_ == 0 && n <= 1) {
+			T v = size_ ? ptr_[0] : T();
+			one_ = v;
+			cap_ = 1;
+		}
+		else if (cap_ == 0 || n > cap_) {
+			grow(static_cast<uint32_t>(std::max(n, static_cast<size_t>(2))));
+		}
+	}
+
+	void resize(size_t n) {
+		reserve(n);
+		std::fill(begin() + std::min(static_cast<size_t>(size_), n), begin() + n, T());
+		size_ = static_cast<uint32_t>(n);
+	}
+
+	void clear() {
+		release();
+		size_ = 0;
+		cap_ = 1;
+		one_ = T();
+	}
+
+	void push_back(const T& v) {
+		if (cap_ == 0 || size_ == cap_) {
+			reserve(size_ ? size_ * 2 : 1);
+		}
+		data()[size_++] = v;
+	}
+
+	iterator insert(iterator it, const T& v) {
+		size_t i = it - begin();
+		push_back(v);
+		std::rotate(begin() + i, end() - 1, end());
+		return begin() + i;
+	}
+
+	bool operator==(const small_vector& o) const {
+		return size_ == o.size_ && std::equal(begin(), end(), o.begin());
+	}
+
+	bool operator!=(const small_vector& o) const {
+		return !(*this == o);
+	}
+};
+
+template<typename String, typename Count>
+class trie_da_builder;
+
+template<typename String, typename Count>
+class trie_louds_builder;
+
+template<typename String, typename Count>
+class trie_compact_builder;
+
+template<typename String=u16string, typename Count=uint32_t>
+class trie {
+private:
+	friend class trie_da_builder<String, Count>;
+	friend class trie_louds_builder<String, Count>;
+	friend class trie_compact_builder<String, Count>;
+
+	class trie_node {
+	protected:
+		friend class trie;
+		friend class trie_da_builder<String, Count>;
+		friend class trie_louds_builder<String, Count>;
+		friend class trie_compact_builder<String, Count>;
+
+		typedef trie_node node_type;
+		typedef small_vector<std::pair<typename String::value_type, Count> > children_type;
+		typedef std::map<String,size_t> query_type;
+		typedef trie root_type;
+
+		bool terminal;
+		typename String::value_type self;
+		Count num_terminals;
+		Count children_depth;
+		// Weight of the word ending here, the sum over all the times it was added
+		Count weight;
+		// 1 + the index in trie::values of the value of the word ending here, or 0 if it has none
+		Count value;
+		children_type children;
+
+	public:
+
+		trie_node(typename String::value_type self = typename String::value_type()) :
+		terminal(false),
+		self(self),
+		num_terminals(0),
+		children_depth(0),
+		weight(0),
+		value(0)
+		{
+		}
+
+		bool add(root_type& root, const String& entry, size_t pos=0, Count weight=0, Count value=0) {
+			size_t self = this - &root.nodes.front();
+			bool rv = false;
+			children_depth = std::max(children_depth, static_cast<Count>(entry.size() - pos));
+			if (pos < entry.size()) {
+				typename children_type::iterator child = findchild(children, entry[pos]);
+				if (child != children.end()) {
+					node_type& node = root.nodes[child->second];
+					rv = node.add(root, entry, pos+1, weight, value);
+				}
+				else {
+					Count z = static_cast<Count>(root.nodes.size());
+					insertchild(children, std::make_pair(entry[pos], z));
+					root.nodes.resize(z+1);
+					root.nodes.back() = node_type(entry[pos]);
+					rv = root.nodes.back().add(root, entry, pos+1, weight, value);
+				}
+			}
+			else {
+				if (!terminal) {
+					terminal = true;
+					rv = true;
+				}
+				this->weight = add_weight(this->weight, weight);
+				if (value) {
+					this->value = value;
+				}
+			}
+			if (rv) {
+				++root.nodes[self].num_terminals;
+			}
+			return rv;
+		}
+
+		// word holds the labels on the path to here, and state is the automaton's state after them; the states of the nodes below follow it
+		template<typename Sink>
+		void query(const root_type& root, const levenshtein_automaton<String>& la, uint64_t *state, String& word, size_t maxdist, Sink& sink) const {
+			if (terminal) {
+				size_t dist = la.distance(state);
+				if (dist <= maxdist) {
+					sink(static_cast<const String&>(word), dist);
+				}
+			}
+
+			uint64_t *below = state + la.state_size();
+			for (typename children_type::const_iterator child = children.begin() ; child != children.end() ; ++child) {
+				if (la.step(state, below, child->first)) {
+					word.push_back(child->first);
+					root.nodes[child->second].query(root, la, below, word, maxdist, sink);
+					word.pop_back();
+				}
+			}
+		}
+	};
+
+	friend class trie_node;
+
+	typedef trie_node node_type;
+	typedef std::vector<node_type> node_container_type;
+	// Otherwise every reallocation of nodes copies all the child lists instead of moving them
+	static_assert(std::is_nothrow_move_constructible<node_type>::value, "trie nodes must be nothrow movable");
+	typedef typename node_type::children_type children_type;
+
+	// Sums weights, stopping at the largest Count rather than wrapping
+	static Count add_weight(Count a, Count b) {
+		return (a > std::numeric_limits<Count>::max() - b) ? std::numeric_limits<Count>::max() : static_cast<Count>(a + b);
+	}
+
+	// Structural hash over label, finality, weight, value and children, valid once all children point at canonical nodes
+	struct register_hash {
+		const node_container_type *nodes;
+
+		register_hash(const node_container_type *nodes = 0) :
+			nodes(nodes) {
+		}
+
+		size_t operator()(Count a) const {
+			const node_type& n = (*nodes)[a];
+			size_t rv = 104729;
+			rv ^= static_cast<size_t>(n.self) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+			rv ^= static_cast<size_t>(n.terminal) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+			rv ^= static_cast<size_t>(n.weight) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+			rv ^= static_cast<size_t>(n.value) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+			for (const auto& ch : n.children) {
+				rv ^= static_cast<size_t>(ch.second) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+			}
+			return rv;
+		}
+	};
+
+	// Two registered nodes are equal iff they have the same right language, with the same weight and value on each word.
+	// Values are interned, so equal values have equal ids.
+	struct register_equal {
+		const node_container_type *nodes;
+
+		register_equal(const node_container_type *nodes = 0) :
+			nodes(nodes) {
+		}
+
+		bool operator()(Count a, Count b) const {
+			const node_type& na = (*nodes)[a];
+			const node_type& nb = (*nodes)[b];
+			return na.self == nb.self && na.terminal == nb.terminal && na.weight == nb.weight && na.value == nb.value && na.children == nb.children;
+		}
+	};
+	typedef std::unordered_set<Count, register_hash, register_equal> hash_register_type;
+
+	bool compressed;
+	// Whether any word was added with a weight, which makes serialize() store weights
+	bool weighted;
+	// Each distinct value that was given to add(), once; serialize() stores values if there are any
+	std::vector<std::string> values;
+	std::unordered_map<std::string, Count> value_ids;
+	node_container_type nodes;
+	// Backing store for the child lists of a frozen trie, see freeze()
+	std::vector<typename children_type::value_type> frozen;
+
+	// State for add_sorted(): the nodes along the most recently added word, which are not yet registered
+	node_container_type sorted_path;
+	String sorted_last;
+	hash_register_type sorted_register;
+	bool sorted_merged;
+
+	// The id a node stores for value, see trie_node::value
+	Count intern(const std::string& value) {
+		auto ins = value_ids.insert(std::make_pair(value, static_cast<Count>(values.size() + 1)));
+		if (ins.second) {
+			values.push_back(value);
+		}
+		return ins.first->second;
+	}
+
+	Count register_node(node_type& node) {
+		nodes.push_back(std::move(node));
+		Count z = static_cast<Count>(nodes.size() - 1);
+		auto ins = sorted_register.insert(z);
+		if (!ins.second) {
+			nodes.pop_back();
+			sorted_merged = true;
+		}
+		return *ins.first;
+	}
+
+	void commit_sorted(size_t depth) {
+		while (sorted_path.size() > depth + 1) {
+			Count z = register_node(sorted_path.back());
+			sorted_path.pop_back();
+			sorted_path.back().children.back().second = z;
+		}
+	}
+
+	// add_sorted() with a value, or without one if value is null
+	bool insert_sorted(const String& entry, Count weight, const std::string *value) {
+		if (entry.empty()) {
+			return false;
+		}
+		if (compressed) {
+			return false;
+		}
+		if (sorted_path.empty()) {
+			if (nodes.size() != 1) {
+				throw std::runtime_error("add_sorted() cannot be used on a trie that already has entries from add()");
+			}
+			sorted_path.push_back(std::move(nodes[0]));
+			nodes[0] = node_type();
+		}
+		else if (entry < sorted_last) {
+			throw std::runtime_error("add_sorted() was given input that is not in sorted order");
+		}
+		else if (entry == sorted_last) {
+			sorted_path.back().weight = add_weight(sorted_path.back().weight, weight);
+			if (value) {
+				sorted_path.back().value = intern(*value);
+			}
+			weighted |= (weight != 0);
+			return false;
+		}
+
+		size_t pos = 0;
+		while (pos < entry.size() && pos < sorted_last.size() && entry[pos] == sorted_last[pos]) {
+			++pos;
+		}
+		commit_sorted(pos);
+
+		for (; pos < entry.size(); ++pos) {
+			sorted_path.back().children.push_back(std::make_pair(entry[pos], std::numeric_limits<Count>::max()));
+			sorted_path.push_back(node_type(entry[pos]));
+		}
+		sorted_path.back().terminal = true;
+		sorted_path.back().weight = weight;
+		sorted_path.back().value = value ? intern(*value) : 0;
+		weighted |= (weight != 0);
+
+		for (size_t i=0 ; i<sorted_path.size() ; ++i) {
+			++sorted_path[i].num_terminals;
+			sorted_path[i].children_depth = std::max(sorted_path[i].children_depth, static_cast<Count>(entry.size() - i));
+		}
+		sorted_last = entry;
+		return true;
+	}
+
+	// Packs every child list with more than one entry into one contiguous array in node order and turns the node lists into views of it.
+	// Single children stay inline in their node, which is already as close as they can get.
+	void freeze() {
+		size_t total = 0;
+		for (auto& node : nodes) {
+			if (node.children.size() > 1) {
+				total += node.children.size();
+			}
+		}
+		std::vector<typename children_type::value_type> flat;
+		flat.reserve(total);
+		for (auto& node : nodes) {
+			if (node.children.size() > 1) {
+				flat.insert(flat.end(), node.children.begin(), node.children.end());
+			}
+		}
+		size_t at = 0;
+		for (auto& node : nodes) {
+			if (node.children.size() > 1) {
+				size_t c = node.children.size();
+				node.children.view(flat.data() + at, c);
+				at += c;
+			}
+		}
+		frozen.swap(flat);
+	}
+
+	// Renumbers reachable nodes in preorder of first visit, which is the order compress() leaves nodes in when the words were added in sorted order
+	void renumber_preorder() {
+		std::vector<Count> oldnew(nodes.size(), std::numeric_limits<Count>::max());
+		std::vector<Count> order;
+		order.reserve(nodes.size());
+		std::vector<std::pair<Count, size_t> > stack(1, std::make_pair(static_cast<Count>(0), static_cast<size_t>(0)));
+		oldnew[0] = 0;
+		order.push_back(0);
+		while (!stack.empty()) {
+			std::pair<Count, size_t>& top = stack.back();
+			if (top.second == nodes[top.first].children.size()) {
+				stack.pop_back();
+				continue;
+			}
+			Count c = nodes[top.first].children[top.second++].second;
+			if (oldnew[c] == std::numeric_limits<Count>::max()) {
+				oldnew[c] = static_cast<Count>(order.size());
+				order.push_back(c);
+				stack.push_back(std::make_pair(c, static_cast<size_t>(0)));
+			}
+		}
+
+		node_container_type tosave;
+		tosave.reserve(order.size());
+		for (size_t i=0 ; i<order.size() ; ++i) {
+			tosave.push_back(std::move(nodes[order[i]]));
+			for (size_t c=0 ; c<tosave.back().children.size() ; ++c) {
+				tosave.back().children[c].second = oldnew[tosave.back().children[c].second];
+			}
+		}
+		nodes.swap(tosave);
+	}
+
+	static constexpr Count absorbed = std::numeric_limits<Count>::max();
+	static constexpr Count max_chain = 0x7FFF;
+
+	// For path compression: the number of nodes chained into each node's record, or absorbed for nodes that are chained into another record
+	std::vector<Count> chains(const serialize_options& opts) const {
+		std::vector<Count> chain(nodes.size(), 0);
+		if (!opts.path_compress) {
+			return chain;
+		}
+		// A node can be chained if its only parent has no other children, and it is not terminal, so no word ends in the middle of a chain
+		std::vector<uint8_t> parents(nodes.size(), 0);
+		for (auto& node : nodes) {
+			for (auto& ch : node.children) {
+				parents[ch.second] = static_cast<uint8_t>(std::min(parents[ch.second] + 1, 2));
+			}
+		}
+		std::vector<bool> joins(nodes.size(), false);
+		for (auto& node : nodes) {
+			if (node.children.size() == 1) {
+				Count y = node.children.front().second;
+				joins[y] = (parents[y] == 1 && !nodes[y].terminal && !nodes[y].children.empty());
+			}
+		}
+		// Nodes left over when a chain hits max_chain start their own, which the second pass picks up
+		std::vector<bool> head(nodes.size(), false);
+		for (int pass = 0; pass < 2; ++pass) {
+			for (size_t n = 0; n < nodes.size(); ++n) {
+				if (head[n] || chain[n] == absorbed || joins[n] != (pass == 1)) {
+					continue;
+				}
+				head[n] = true;
+				Count x = static_cast<Count>(n);
+				while (chain[n] < max_chain && nodes[x].children.size() == 1) {
+					Count y = nodes[x].children.front().second;
+					if (!joins[y] || head[y]) {
+						break;
+					}
+					chain[y] = absorbed;
+					x = y;
+					++chain[n];
+				}
+			}
 		}
+		return chain;
 	}
-	return t.insert(it, std::move(y));
-}
-
-template<typename String=u16string, typename Count=uint32_t>
-class trie {
-private:
-
-	class trie_node {
-	protected:
-		friend class trie;
 
-		typedef trie_node node_type;
-		typedef std::vector<std::pair<typename String::value_type, Count> > children_type;
-		typedef std::vector<const node_type*> query_path_type;
-		typedef std::map<String,size_t> query_type;
-		typedef trie root_type;
+	// The last node of n's chain, whose children the record holds
+	Count chain_tail(size_t n, const std::vector<Count>& chain) const {
+		Count x = static_cast<Count>(n);
+		for (Count i = 0; i < chain[n]; ++i) {
+			x = nodes[x].children.front().second;
+		}
+		return x;
+	}
 
-		bool terminal;
-		typename String::value_type self;
-		Count num_terminals;
-		Count children_depth;
-		children_type children;
+	size_t record_size(size_t n, const std::vector<Count>& chain, size_t width) const {
+		if (chain[n] == absorbed) {
+			return 0;
+		}
+		size_t c = nodes[chain_tail(n, chain)].children.size();
+		size_t links = chain[n] ? chain[n]*(sizeof(uint16_t) + sizeof(uint16_t)) + sizeof(Count) : 0;
+		size_t extras = (weighted ? 2*sizeof(Count) : 0) + (values.empty() ? 0 : sizeof(Count));
+		return sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + links + extras + sizeof(Count) + labels_size(c, width) + c*sizeof(Count);
+	}
 
-		void buildString(const query_path_type& qp, String& in) const {
-			in.reserve(qp.size());
-			for (typename query_path_type::const_iterator it = qp.begin() ; it != qp.end() ; ++it) {
-				in.push_back((*it)->self);
+	// File offset of each value that some word still has, by value id with 0 for none, given that the values start at base; end is set to where they stop.
+	// Values that were replaced or erased are left out.
+	std::vector<Count> value_offsets(size_t base, size_t& end) const {
+		std::vector<Count> ofs(values.size() + 1, 0);
+		end = base;
+		if (values.empty()) {
+			return ofs;
+		}
+		for (auto& node : nodes) {
+			if (node.terminal && node.value) {
+				ofs[node.value] = 1;
 			}
 		}
-
-	public:
-
-		trie_node(typename String::value_type self = typename String::value_type()) :
-		terminal(false),
-		self(self),
-		num_terminals(0),
-		children_depth(0)
-		{
+		end += sizeof(Count);
+		for (size_t v = 1; v < ofs.size(); ++v) {
+			if (ofs[v]) {
+				ofs[v] = static_cast<Count>(end);
+				end += sizeof(Count) + labels_size(values[v-1].size(), 1);
+			}
 		}
+		return ofs;
+	}
 
-		bool add(root_type& root, const String& entry, size_t pos=0) {
-			size_t self = this - &root.nodes.front();
-			bool rv = false;
-			children_depth = std::max(children_depth, static_cast<Count>(entry.size() - pos));
-			if (pos < entry.size()) {
-				typename children_type::iterator child = findchild(children, entry[pos]);
-				if (child != children.end()) {
-					node_type& node = root.nodes[child->second];
-					rv = node.add(root, entry, pos+1);
-				}
-				else {
-					Count z = static_cast<Count>(root.nodes.size());
-					insertchild(children, std::make_pair(entry[pos], z));
-					root.nodes.resize(z+1);
-					root.nodes.back() = node_type(entry[pos]);
-					rv = root.nodes.back().add(root, entry, pos+1);
-				}
+	// Largest weight of any word in each node's subtree, the node's own word included
+	std::vector<Count> max_weights() const {
+		std::vector<Count> best(nodes.size(), 0);
+		std::vector<bool> done(nodes.size(), false);
+		std::vector<std::pair<Count, size_t> > stack;
+		for (size_t i=0 ; i<nodes.size() ; ++i) {
+			if (done[i]) {
+				continue;
 			}
-			else {
-				if (!terminal) {
-					terminal = true;
-					rv = true;
+			stack.push_back(std::make_pair(static_cast<Count>(i), static_cast<size_t>(0)));
+			while (!stack.empty()) {
+				std::pair<Count, size_t>& top = stack.back();
+				const node_type& node = nodes[top.first];
+				if (top.second == node.children.size()) {
+					best[top.first] = node.weight;
+					for (auto& ch : node.children) {
+						best[top.first] = std::max(best[top.first], best[ch.second]);
+					}
+					done[top.first] = true;
+					stack.pop_back();
+					continue;
+				}
+				Count c = node.children[top.second++].second;
+				if (!done[c]) {
+					stack.push_back(std::make_pair(c, static_cast<size_t>(0)));
 				}
 			}
-			if (rv) {
-				++root.nodes[self].num_terminals;
-			}
-			return rv;
 		}
+		return best;
+	}
 
-		void query(const root_type& root, const String& entry, size_t pos, query_type& collected, query_path_type& qp, size_t maxdist=0, size_t curdist=0) const {
-			qp.push_back(this);
+	// Node numbers in the order serialize() writes their records. The root always comes first, since readers start at the first record.
+	std::vector<Count> layout(const serialize_options& opts, const std::vector<Count>& chain, size_t width) const {
+		std::vector<Count> order;
+		order.reserve(nodes.size());
+		std::vector<bool> placed(nodes.size(), false);
+		auto place = [&](Count n) {
+			placed[n] = true;
+			order.push_back(n);
+		};
 
-			if (pos < entry.size()) {
-				typename children_type::const_iterator child = findchild(children, entry[pos]);
-				if (child != children.end()) {
-					root.nodes[child->second].query(root, entry, pos+1, collected, qp, maxdist, curdist);
+		if (opts.layout == serialize_options::layout_bfs) {
+			place(0);
+			for (size_t i = 0; i < order.size(); ++i) {
+				for (auto& ch : nodes[order[i]].children) {
+					if (!placed[ch.second]) {
+						place(ch.second);
+					}
 				}
 			}
-
-			if (curdist < maxdist) {
-				for (typename children_type::const_iterator child = children.begin() ; child != children.end() ; ++child) {
-					if (pos >= entry.size() || child->first != entry[pos]) {
-						root.nodes[child->second].query(root, entry, pos, collected, qp, maxdist, curdist+1);
-						root.nodes[child->second].query(root, entry, pos+1, collected, qp, maxdist, curdist+1);
+		}
+		else if (opts.layout == serialize_options::layout_dfs) {
+			std::vector<Count> stack(1, 0);
+			while (!stack.empty()) {
+				Count n = stack.back();
+				stack.pop_back();
+				if (placed[n]) {
+					continue;
+				}
+				place(n);
+				auto& children = nodes[n].children;
+				for (size_t c = children.size(); c-- > 0;) {
+					if (!placed[children[c].second]) {
+						stack.push_back(children[c].second);
 					}
-					for (size_t i = 1 ; pos+i < entry.size() ; ++i) {
-						if (child->first == entry[pos+i]) {
-							root.nodes[child->second].query(root, entry, pos+i+1, collected, qp, maxdist, curdist+i);
-						}
+				}
+			}
+		}
+		else if (opts.layout == serialize_options::layout_clustered || opts.layout == serialize_options::layout_profile) {
+			if (opts.layout == serialize_options::layout_profile) {
+				// Parents are visited at least as often as their children, so this keeps most hot paths in top down order too
+				std::vector<Count> hot;
+				for (size_t n = 1; n < std::min(nodes.size(), opts.heat.size()); ++n) {
+					if (opts.heat[n]) {
+						hot.push_back(static_cast<Count>(n));
 					}
 				}
+				std::stable_sort(hot.begin(), hot.end(), [&](Count a, Count b) {
+					return opts.heat[a] > opts.heat[b];
+				});
+				place(0);
+				for (Count n : hot) {
+					place(n);
+				}
 			}
-
-			if (terminal) {
-				size_t dist = curdist;
-				if (pos < entry.size()) {
-					dist += entry.size() - pos;
+			const size_t page = page_size();
+			std::vector<Count> roots, level, next;
+			// Cold subtrees hang off the placed nodes, or off the root if nothing is placed yet
+			if (order.empty()) {
+				roots.push_back(0);
+			}
+			for (size_t i = order.size(); i-- > 0;) {
+				auto& children = nodes[order[i]].children;
+				for (size_t c = children.size(); c-- > 0;) {
+					if (!placed[children[c].second]) {
+						roots.push_back(children[c].second);
+					}
 				}
-				else {
-					dist += pos - entry.size();
+			}
+			while (!roots.empty()) {
+				Count r = roots.back();
+				roots.pop_back();
+				if (placed[r]) {
+					continue;
 				}
-				if (dist <= maxdist) {
-					String out;
-					buildString(qp, out);
-					typename query_type::iterator ins = collected.insert(std::make_pair(out, dist)).first;
-					ins->second = std::min(ins->second, dist);
+				// Fill a page breadth first from r; whatever does not fit roots a cluster of its own
+				size_t bytes = 0;
+				level.assign(1, r);
+				std::vector<Count> spill;
+				while (!level.empty()) {
+					next.clear();
+					for (Count n : level) {
+						if (placed[n]) {
+							continue;
+						}
+						if (bytes >= page) {
+							spill.push_back(n);
+							continue;
+						}
+						place(n);
+						bytes += record_size(n, chain, width);
+						for (auto& ch : nodes[n].children) {
+							if (!placed[ch.second]) {
+								next.push_back(ch.second);
+							}
+						}
+					}
+					level.swap(next);
 				}
+				roots.insert(roots.end(), spill.rbegin(), spill.rend());
 			}
-
-			qp.pop_back();
 		}
 
-	private:
-		bool equals(const root_type& root, const node_type* second) const {
-			if (self != second->self) {
-				return false;
-			}
-			if (num_terminals != second->num_terminals) {
-				return false;
+		// Creation order, and any nodes the walks above did not reach
+		for (size_t n = 0; n < nodes.size(); ++n) {
+			if (!placed[n]) {
+				place(static_cast<Count>(n));
 			}
-			if (children_depth != second->children_depth) {
-				return false;
-			}
-			if (terminal != second->terminal) {
-				return false;
-			}
-			if (children.size() != second->children.size()) {
-				return false;
+		}
+		return order;
+	}
+
+	// The symbol table serialize() will write, which is empty unless asked for and there are at most 255 distinct labels
+	std::vector<typename String::value_type> symbols(const serialize_options& opts) const {
+		if (!opts.alphabet) {
+			return std::vector<typename String::value_type>();
+		}
+		return alphabet();
+	}
+
+	// Restores children_depth, which is not serialized but which compress() relies on
+	void compute_depths() {
+		std::vector<bool> done(nodes.size(), false);
+		std::vector<std::pair<Count, size_t> > stack;
+		for (size_t i=0 ; i<nodes.size() ; ++i) {
+			if (done[i]) {
+				continue;
 			}
-			for (typename children_type::const_iterator mine = children.begin(), other = second->children.begin()
-				; mine != children.end() && other != second->children.end() ; ++mine, ++other) {
-				const node_type *nmine = &root.nodes[mine->second];
-				const node_type *nother = &root.nodes[other->second];
-				if (!nmine->equals(root, nother)) {
-					return false;
+			stack.push_back(std::make_pair(static_cast<Count>(i), static_cast<size_t>(0)));
+			while (!stack.empty()) {
+				std::pair<Count, size_t>& top = stack.back();
+				node_type& node = nodes[top.first];
+				if (top.second == node.children.size()) {
+					node.children_depth = 0;
+					for (auto& ch : node.children) {
+						node.children_depth = std::max(node.children_depth, static_cast<Count>(nodes[ch.second].children_depth + 1));
+					}
+					done[top.first] = true;
+					stack.pop_back();
+					continue;
+				}
+				Count c = node.children[top.second++].second;
+				if (!done[c]) {
+					stack.push_back(std::make_pair(c, static_cast<size_t>(0)));
 				}
 			}
-			return true;
 		}
-	};
-
-	friend class trie_node;
+	}
 
-	typedef trie_node node_type;
-	typedef std::vector<node_type> node_container_type;
-	typedef std::vector<const node_type*> query_path_type;
+	template<typename F>
+	static void run_chunks(size_t jobs, F f) {
+		std::vector<std::thread> workers;
+		for (size_t j = 1; j < jobs; ++j) {
+			workers.push_back(std::thread(f, j));
+		}
+		f(0);
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
 
-	bool compressed;
-	node_container_type nodes;
+	void finish_sorted(bool verbose) {
+		commit_sorted(0);
+		nodes[0] = std::move(sorted_path.back());
+		sorted_path.clear();
+		sorted_last.clear();
+		sorted_register.clear();
+
+		renumber_preorder();
+		freeze();
+		compressed = sorted_merged;
+		if (verbose) {
+			std::cerr << "Minimized to " << nodes.size() << " nodes." << std::endl;
+		}
+	}
 
 public:
 	class const_iterator {
@@ -493,102 +1763,417 @@ public:
 
 	trie() :
 		compressed(false),
-		nodes(1) {
+		weighted(false),
+		nodes(1),
+		sorted_register(0, register_hash(&nodes), register_equal(&nodes)),
+		sorted_merged(false) {
 	}
 
-	void serialize(std::ostream& out) const {
-		std::vector<Count> ofs(nodes.size());
+	trie(const trie& o) :
+		compressed(o.compressed),
+		weighted(o.weighted),
+		values(o.values),
+		value_ids(o.value_ids),
+		nodes(o.nodes),
+		sorted_path(o.sorted_path),
+		sorted_last(o.sorted_last),
+		sorted_register(o.sorted_register.begin(), o.sorted_register.end(), 0, register_hash(&nodes), register_equal(&nodes)),
+		sorted_merged(o.sorted_merged) {
+		if (!o.frozen.empty()) {
+			freeze();
+		}
+	}
 
-		const char *trie = "TRIE";
-		out.write(trie, 4);
-		write(out, TRIE_SERIALIZED_REVISION);
+	trie& operator=(const trie& o) {
+		if (this != &o) {
+			compressed = o.compressed;
+			weighted = o.weighted;
+			values = o.values;
+			value_ids = o.value_ids;
+			nodes = o.nodes;
+			sorted_path = o.sorted_path;
+			sorted_last = o.sorted_last;
+			sorted_register = hash_register_type(o.sorted_register.begin(), o.sorted_register.end(), 0, register_hash(&nodes), register_equal(&nodes));
+			sorted_merged = o.sorted_merged;
+			std::vector<typename children_type::value_type>().swap(frozen);
+			if (!o.frozen.empty()) {
+				freeze();
+			}
+		}
+		return *this;
+	}
 
-		uint16_t z = sizeof(typename String::value_type);
-		write(out, z);
+	/*
+	Distinct edge labels ordered by how many edges carry them, most frequent first with ties in code unit order, or empty if there are more than 255.
+	This is the symbol table serialize() writes with serialize_options::alphabet.
+	*/
+	std::vector<typename String::value_type> alphabet() const {
+		std::map<typename String::value_type, size_t> freq;
+		for (auto& node : nodes) {
+			for (auto& ch : node.children) {
+				++freq[ch.first];
+			}
+		}
+		std::vector<typename String::value_type> rv;
+		if (freq.size() > 255) {
+			return rv;
+		}
+		std::vector<std::pair<size_t, typename String::value_type> > order;
+		for (auto& f : freq) {
+			order.push_back(std::make_pair(std::numeric_limits<size_t>::max() - f.second, f.first));
+		}
+		std::sort(order.begin(), order.end());
+		for (auto& o : order) {
+			rv.push_back(o.second);
+		}
+		return rv;
+	}
 
-		z = compressed;
-		write(out, z);
+	// Adds weight to heat[n] for each node n that an exact lookup of entry passes through, which serialize_options::layout_profile packs together.
+	// Replaying logged queries this way also counts the prefix that a misspelled word shares with the trie, which is where spell checking starts.
+	void count_visits(const String& entry, std::vector<size_t>& heat, size_t weight = 1) const {
+		heat.resize(nodes.size());
+		Count n = 0;
+		heat[n] += weight;
+		for (auto c : entry) {
+			typename node_type::children_type::const_iterator child = findchild(nodes[n].children, c);
+			if (child == nodes[n].children.end()) {
+				break;
+			}
+			n = child->second;
+			heat[n] += weight;
+		}
+	}
 
-		Count value = static_cast<Count>(nodes.size());
-		write(out, value);
+	// Bytes serialize() will produce: the header, the symbol table, the values, one record per node, and the optional trailing offset index
+	size_t serialized_size(const serialize_options& opts = serialize_options()) const {
+		std::vector<Count> chain = chains(opts);
+		size_t syms = symbols(opts).size();
+		size_t width = syms ? sizeof(uint8_t) : sizeof(typename String::value_type);
+		size_t total = 0;
 		for (size_t n = 0; n<nodes.size(); ++n) {
-			ofs[n] = bswap(static_cast<Count>(out.tellp()));
-			z = nodes[n].self;
-			write(out, z);
-			z = nodes[n].terminal;
-			write(out, z);
-			write(out, nodes[n].num_terminals);
+			total += record_size(n, chain, width);
+		}
+		size_t vals = 0;
+		value_offsets(0, vals);
+		return trie_header::size() + labels_size(syms, sizeof(uint16_t)) + vals + total + (opts.index ? nodes.size()*sizeof(Count) : 0);
+	}
+
+	/*
+	Serializes into buf, which must hold serialized_size() bytes, e.g. a pre-sized memory mapped output file.
+	Node offsets are computed from record sizes rather than by tracking the output position, so the nodes can be split into chunks that are written on separate threads.
+	The chunks are runs of layout(), so records land in the order serialize_options::layout asks for.
+	*/
+	void serialize(char *buf, const serialize_options& opts = serialize_options()) const {
+		size_t jobs = std::max(static_cast<size_t>(1), std::min(opts.jobs, nodes.size() / 65536 + 1));
+		size_t chunk = (nodes.size() + jobs - 1) / jobs;
+		std::vector<Count> chain = chains(opts);
+		// With a symbol table every label is written as its id; ids[] maps code units to them, with 0 for the root's non-label
+		std::vector<typename String::value_type> syms = symbols(opts);
+		std::vector<uint16_t> ids(size_t(1) << (8*sizeof(typename String::value_type)));
+		for (size_t i = 0; i < syms.size(); ++i) {
+			ids[syms[i]] = static_cast<uint16_t>(i + 1);
+		}
+		auto label = [&](typename String::value_type c) {
+			return syms.empty() ? static_cast<uint16_t>(c) : ids[c];
+		};
+		size_t width = syms.empty() ? sizeof(typename String::value_type) : sizeof(uint8_t);
+		std::vector<Count> order = layout(opts, chain, width);
+		std::vector<Count> best;
+		if (weighted) {
+			best = max_weights();
+		}
 
-			write(out, static_cast<Count>(nodes[n].children.size()));
-			for (size_t c = 0; c<nodes[n].children.size(); ++c) {
-				write(out, nodes[n].children[c].second);
+		std::vector<size_t> starts(jobs + 1, 0);
+		run_chunks(jobs, [&](size_t j) {
+			for (size_t k = j*chunk; k < std::min(nodes.size(), (j+1)*chunk); ++k) {
+				size_t n = order[k];
+				starts[j+1] += record_size(n, chain, width);
+			}
+		});
+		char *sp = buf + trie_header::size();
+		for (size_t i = 0; i < syms.size(); ++i) {
+			sp = write(sp, static_cast<uint16_t>(syms[i]));
+		}
+		for (char *e = buf + trie_header::size() + labels_size(syms.size(), sizeof(uint16_t)); sp != e; ++sp) {
+			*sp = 0;
+		}
+		char *vp = sp;
+		size_t vend = 0;
+		std::vector<Count> vofs = value_offsets(vp - buf, vend);
+		if (!values.empty()) {
+			Count nv = 0;
+			sp += sizeof(Count);
+			for (size_t v = 1; v < vofs.size(); ++v) {
+				if (!vofs[v]) {
+					continue;
+				}
+				++nv;
+				const std::string& value = values[v-1];
+				sp = write(sp, static_cast<Count>(value.size()));
+				memcpy(sp, value.data(), value.size());
+				memset(sp + value.size(), 0, labels_size(value.size(), 1) - value.size());
+				sp += labels_size(value.size(), 1);
 			}
+			write(vp, nv);
+		}
+		starts[0] = sp - buf;
+		for (size_t j = 1; j <= jobs; ++j) {
+			starts[j] += starts[j-1];
 		}
-		out.write(const_char_p(ofs.data()), ofs.size()*sizeof(Count));
+
+		// Children point straight at their records, so all offsets must be known before any record is written
+		std::vector<Count> ofs(nodes.size());
+		run_chunks(jobs, [&](size_t j) {
+			size_t at = starts[j];
+			for (size_t k = j*chunk; k < std::min(nodes.size(), (j+1)*chunk); ++k) {
+				size_t n = order[k];
+				if (chain[n] == absorbed) {
+					continue;
+				}
+				ofs[n] = static_cast<Count>(at);
+				Count x = static_cast<Count>(n);
+				for (Count i = 0; i < chain[n]; ++i) {
+					x = nodes[x].children.front().second;
+					ofs[x] = static_cast<Count>(at + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + i*(sizeof(uint16_t) + sizeof(uint16_t)));
+				}
+				at += record_size(n, chain, width);
+			}
+		});
+
+		char *index = buf + starts[jobs];
+		run_chunks(jobs, [&](size_t j) {
+			char *p = buf + starts[j];
+			for (size_t k = j*chunk; k < std::min(nodes.size(), (j+1)*chunk); ++k) {
+				size_t n = order[k];
+				if (opts.index) {
+					write(index + n*sizeof(Count), ofs[n]);
+				}
+				if (chain[n] == absorbed) {
+					continue;
+				}
+				p = write(p, label(nodes[n].self));
+				p = write(p, static_cast<uint16_t>(0x8000 | (chain[n] ? 0x0002 : 0) | (nodes[n].terminal ? 0x0001 : 0)));
+				p = write(p, nodes[n].num_terminals);
+				const node_type *x = &nodes[n];
+				for (Count i = 0; i < chain[n]; ++i) {
+					x = &nodes[x->children.front().second];
+					p = write(p, label(x->self));
+					p = write(p, static_cast<uint16_t>(chain[n] - i - 1));
+				}
+				if (chain[n]) {
+					p = write(p, x->num_terminals);
+				}
+				if (weighted) {
+					Count below = 0;
+					for (auto& ch : x->children) {
+						below = std::max(below, best[ch.second]);
+					}
+					p = write(p, nodes[n].weight);
+					p = write(p, below);
+				}
+				if (!values.empty()) {
+					p = write(p, nodes[n].terminal ? vofs[nodes[n].value] : static_cast<Count>(0));
+				}
+				p = write(p, static_cast<Count>(x->children.size()));
+				char *ls = p;
+				for (size_t c = 0; c<x->children.size(); ++c) {
+					if (syms.empty()) {
+						p = write(p, x->children[c].first);
+					}
+					else {
+						*p++ = static_cast<char>(ids[x->children[c].first]);
+					}
+				}
+				for (char *e = ls + labels_size(x->children.size(), width); p != e; ++p) {
+					*p = 0;
+				}
+				for (size_t c = 0; c<x->children.size(); ++c) {
+					p = write(p, ofs[x->children[c].second]);
+				}
+			}
+		});
+
+		trie_header hdr;
+		hdr.revision = TRIE_SERIALIZED_REVISION;
+		hdr.width = sizeof(typename String::value_type);
+		hdr.flags = static_cast<uint16_t>((compressed ? 0x0001 : 0) | (weighted ? 0x0002 : 0) | (values.empty() ? 0 : 0x0004));
+		hdr.num_nodes = static_cast<uint32_t>(nodes.size());
+		hdr.symbols_offset = static_cast<uint32_t>(trie_header::size());
+		hdr.num_symbols = static_cast<uint32_t>(syms.size());
+		hdr.values_offset = static_cast<uint32_t>(vp - buf);
+		hdr.values_size = static_cast<uint32_t>(vend - (vp - buf));
+		hdr.nodes_offset = static_cast<uint32_t>(starts[0]);
+		hdr.nodes_size = static_cast<uint32_t>(starts[jobs] - starts[0]);
+		hdr.index_offset = static_cast<uint32_t>(starts[jobs]);
+		hdr.index_size = static_cast<uint32_t>(opts.index ? nodes.size()*sizeof(Count) : 0);
+		hdr.checksum = checksum(buf + hdr.symbols_offset, hdr.index_offset + hdr.index_size - hdr.symbols_offset);
+		hdr.write(buf);
+	}
+
+	void serialize(std::ostream& out, const serialize_options& opts = serialize_options()) const {
+		std::vector<char> buf(serialized_size(opts));
+		serialize(buf.data(), opts);
+		out.write(buf.data(), buf.size());
 	}
 
 	void unserialize(std::istream& in) {
 		clear();
 
-		std::string trie(4, 0);
-		in.read(&trie[0], 4);
-		if (trie != "TRIE") {
-			throw std::runtime_error("Unserialize stream did not start with magic byte sequence TRIE");
-		}
-
-		auto rev = read<uint32_t>(in);
-		if (rev != TRIE_SERIALIZED_REVISION) {
-			char _msg[] = "Unserialize expected revision %u but data had revision %u";
-			std::string msg(sizeof(_msg)+11 + 11 + 1, 0);
-			msg.resize(sprintf(&msg[0], _msg, TRIE_SERIALIZED_REVISION, rev));
-			throw std::runtime_error(msg);
+		std::string buf(trie_header::size(), 0);
+		in.read(&buf[0], buf.size());
+		trie_header hdr;
+		// The stream length is unknown, so only a short header can be caught here
+		size_t avail = (static_cast<size_t>(in.gcount()) == buf.size()) ? std::numeric_limits<size_t>::max() : static_cast<size_t>(in.gcount());
+		hdr.read(buf.data(), avail, sizeof(typename String::value_type));
+		compressed = ((hdr.flags & 0x0001) != 0);
+		weighted = ((hdr.flags & 0x0002) != 0);
+		in.ignore(hdr.symbols_offset - trie_header::size());
+		// Index 0 decodes the root's non-label; without a symbol table labels are stored as is
+		std::vector<typename String::value_type> syms(1);
+		for (size_t i = 0; i < hdr.num_symbols; ++i) {
+			syms.push_back(static_cast<typename String::value_type>(read<uint16_t>(in)));
 		}
-
-		auto s = read<uint16_t>(in);
-		if (s != sizeof(typename String::value_type)) {
-			char _msg[] = "Unserialize expected code unit width %u but data had width %u";
-			std::string msg(sizeof(_msg)+11 + 11 + 1, 0);
-			msg.resize(sprintf(&msg[0], _msg, sizeof(typename String::value_type), s));
-			throw std::runtime_error(msg);
+		in.ignore(hdr.values_offset - hdr.symbols_offset - hdr.num_symbols*sizeof(uint16_t));
+		// Records point at values by file offset
+		std::unordered_map<Count, Count> value_at;
+		Count vat = hdr.values_offset;
+		if (hdr.flags & 0x0004) {
+			Count nv = read<Count>(in);
+			vat += static_cast<Count>(sizeof(Count));
+			for (Count v = 0; v < nv; ++v) {
+				Count len = read<Count>(in);
+				if (len > hdr.values_size) {
+					throw std::runtime_error("Unserialize found a value longer than the values section");
+				}
+				std::string value(len, 0);
+				in.read(&value[0], len);
+				in.ignore(labels_size(len, 1) - len);
+				value_at[vat] = intern(value);
+				vat += static_cast<Count>(sizeof(Count) + labels_size(len, 1));
+			}
 		}
+		in.ignore(hdr.nodes_offset - vat);
+		auto label = [&](uint16_t s) {
+			if (hdr.num_symbols == 0) {
+				return static_cast<typename String::value_type>(s);
+			}
+			if (s >= syms.size()) {
+				throw std::runtime_error("Unserialize found a label that is not in the symbol table");
+			}
+			return syms[s];
+		};
+		size_t width = hdr.num_symbols ? sizeof(uint8_t) : sizeof(typename String::value_type);
 
-		read(in, s);
-		compressed = (s != 0);
-
-		auto z = read<Count>(in);
+		uint16_t s = 0;
+		Count z = hdr.num_nodes;
 		nodes.resize(z);
+		std::vector<Count> ofs(z);
+		Count at = hdr.nodes_offset;
+		// Chained nodes get their own numbers right after their record's node, so ofs stays sorted
 		for (size_t n = 0; n < z; ++n) {
+			size_t head = n;
+			ofs[n] = at;
+			at += static_cast<Count>(sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + sizeof(Count));
 			read(in, s);
-			nodes[n].self = static_cast<typename String::value_type>(s);
+			nodes[n].self = label(s);
 			read(in, s);
-			nodes[n].terminal = (s != 0);
+			nodes[n].terminal = ((s & 0x0001) != 0);
 			read(in, nodes[n].num_terminals);
 
+			if (s & 0x0002) {
+				uint16_t left = 0;
+				do {
+					if (n + 1 >= z) {
+						throw std::runtime_error("Unserialize found a chain running past the node count");
+					}
+					nodes[n].children.resize(1);
+					nodes[n].children[0].second = at - static_cast<Count>(sizeof(Count));
+					++n;
+					ofs[n] = at - static_cast<Count>(sizeof(Count));
+					at += static_cast<Count>(sizeof(uint16_t) + sizeof(uint16_t));
+					read(in, s);
+					nodes[n].self = label(s);
+					read(in, left);
+				} while (left);
+				read(in, nodes[n].num_terminals);
+				at += static_cast<Count>(sizeof(Count));
+			}
+			if (weighted) {
+				// The largest weight below is derived data, which serialize() recomputes
+				read(in, nodes[head].weight);
+				read<Count>(in);
+				at += static_cast<Count>(2*sizeof(Count));
+			}
+			if (hdr.flags & 0x0004) {
+				Count vo = read<Count>(in);
+				at += static_cast<Count>(sizeof(Count));
+				if (vo) {
+					typename std::unordered_map<Count, Count>::iterator it = value_at.find(vo);
+					if (it == value_at.end()) {
+						throw std::runtime_error("Unserialize found a value offset that does not point at a value");
+					}
+					nodes[head].value = it->second;
+				}
+			}
+
 			auto c = read<Count>(in);
+			at += static_cast<Count>(labels_size(c, width) + c * sizeof(Count));
 			nodes[n].children.resize(c);
+			// Labels are restored from the child records below
+			in.ignore(labels_size(c, width));
 			for (size_t c = 0; c < nodes[n].children.size(); ++c) {
 				read(in, nodes[n].children[c].second);
 			}
 		}
+		// Child slots hold record offsets; turn them back into node numbers
 		for (size_t n = 0; n < z; ++n) {
 			for (size_t c = 0; c < nodes[n].children.size(); ++c) {
-				nodes[n].children[c].first = nodes[nodes[n].children[c].second].self;
+				Count& child = nodes[n].children[c].second;
+				typename std::vector<Count>::iterator it = std::lower_bound(ofs.begin(), ofs.end(), child);
+				if (it == ofs.end() || *it != child) {
+					throw std::runtime_error("Unserialize found a child that does not point at a node record");
+				}
+				child = static_cast<Count>(it - ofs.begin());
+				nodes[n].children[c].first = nodes[child].self;
 			}
 		}
+		compute_depths();
+		freeze();
 	}
 
 	bool is_compressed() const {
 		return compressed;
 	}
 
+	bool is_weighted() const {
+		return weighted;
+	}
+
+	bool has_values() const {
+		return !values.empty();
+	}
+
 	size_t size() const {
 		return nodes.size();
 	}
 
+	// Rough estimate of the heap bytes held by the nodes, counting one spilled child entry plus allocator overhead per node
+	size_t memory_usage() const {
+		return nodes.capacity() * sizeof(node_type) + frozen.capacity() * sizeof(typename children_type::value_type) + nodes.size() * (sizeof(typename children_type::value_type) + sizeof(void*));
+	}
+
 	void clear() {
 		compressed = false;
-		nodes.clear();
-		nodes.resize(1);
+		weighted = false;
+		std::vector<std::string>().swap(values);
+		value_ids.clear();
+		node_container_type(1).swap(nodes);
+		std::vector<typename children_type::value_type>().swap(frozen);
+		sorted_path.clear();
+		sorted_last.clear();
+		sorted_register.clear();
+		sorted_merged = false;
 	}
 
 	const_iterator begin() const {
@@ -599,30 +2184,72 @@ public:
 		return const_iterator(this);
 	}
 
-	bool add(const String& entry) {
+	/*
+	Adds entry, and returns whether it was new. A weight, such as how often the word occurs, is added to whatever weight the word already has.
+	Once any word has a weight the serialized trie stores weights, which trie_mmap::top_k() ranks completions by.
+	*/
+	bool add(const String& entry, Count weight = 0) {
+		if (entry.empty()) {
+			return false;
+		}
+		if (compressed) {
+			return false;
+		}
+		weighted |= (weight != 0);
+		return nodes[0].add(*this, entry, 0, weight);
+	}
+
+	/*
+	Adds entry with a value, such as its lemma or tags, that trie_mmap::find_value() returns; adding the word again with another value replaces it.
+	Equal values are stored once, and words with equal values can still share suffixes.
+	*/
+	bool add(const String& entry, Count weight, const std::string& value) {
 		if (entry.empty()) {
 			return false;
 		}
 		if (compressed) {
 			return false;
 		}
-		return nodes[0].add(*this, entry);
+		weighted |= (weight != 0);
+		return nodes[0].add(*this, entry, 0, weight, intern(value));
 	}
 
 	void insert(const String& entry) {
 		add(entry);
 	}
 
+	/*
+	Adds an entry to a trie that is built solely from lexicographically sorted input (by code unit).
+	Subtrees are minimized as soon as no later entry can reach them, so memory is bounded by the size of the final DAWG rather than the full trie.
+	Must not be mixed with add(). Call compress() once all entries are added; the result is identical to add() + compress() on the same input.
+	*/
+	bool add_sorted(const String& entry, Count weight = 0) {
+		return insert_sorted(entry, weight, 0);
+	}
+
+	bool add_sorted(const String& entry, Count weight, const std::string& value) {
+		return insert_sorted(entry, weight, &value);
+	}
+
 	query_type query(const String& entry, size_t maxdist = 0) const {
 		query_type matches;
-		if (!entry.empty()) {
-			query_path_type qp;
-			qp.reserve(entry.size()+maxdist+2);
-			nodes[0].query(*this, entry, 0, matches, qp, maxdist);
-		}
+		query(entry, maxdist, [&](const String& word, size_t dist) {
+			matches.insert(std::make_pair(word, dist));
+		});
 		return matches;
 	}
 
+	/*
+	Calls sink(word, dist) for each word within maxdist edits of entry, in trie order, which is how query() fills its map.
+	word is a buffer that the search reuses, so it is only valid during the call; copy it to keep it. Each word is passed once, with its distance.
+	*/
+	template<typename Sink>
+	void query(const String& entry, size_t maxdist, Sink&& sink) const {
+		search_within<levenshtein_automaton<String>>(entry, maxdist, [&](const levenshtein_automaton<String>& la, uint64_t *states, String& word) {
+			nodes[0].query(*this, la, states, word, maxdist, sink);
+		});
+	}
+
 	const_iterator find(const String& entry) const {
 		const_iterator rv = end();
 		typename node_type::children_type::const_iterator child = findchild(nodes[0].children, entry[0]);
@@ -653,6 +2280,8 @@ public:
 		const_iterator it = find(entry);
 		if (it != end()) {
 			nodes[it.path.back()].terminal = false;
+			nodes[it.path.back()].weight = 0;
+			nodes[it.path.back()].value = 0;
 		}
 	}
 
@@ -672,91 +2301,133 @@ public:
 		return browser(this, static_cast<Count>(n));
 	}
 
-	void compress() {
+	void compress(bool verbose = true) {
 		// ToDo: Add compression ratio to bail out early
+		if (!sorted_path.empty()) {
+			finish_sorted(verbose);
+			return;
+		}
 		if (compressed) {
 			return;
 		}
+		if (minimize(verbose)) {
+			compressed = true;
+		}
+		freeze();
+	}
 
-		typedef std::vector<std::pair<typename String::value_type,std::vector<Count>>> multichild_type;
-		typedef std::vector<multichild_type> depths_type;
-		depths_type depths(nodes[0].children_depth + 1);
-		std::vector<Count> parents(nodes.size(), std::numeric_limits<Count>::max());
-		size_t max_child = 0;
+	/*
+	Builds this trie from parts whose entries have pairwise disjoint first code units, such as shards built on separate threads.
+	The parts are consumed. Suffixes are shared across parts, and nodes are renumbered in preorder so the result does not depend on how entries were split.
+	*/
+	void stitch(std::vector<trie>& parts, bool verbose = true) {
+		clear();
+		bool was_compressed = false;
+		for (auto& part : parts) {
+			part.compress(false);
+			was_compressed |= part.compressed;
+			weighted |= part.weighted;
+			// Value ids are per trie, so move the part's values over to this trie's table
+			std::vector<Count> remap(part.values.size() + 1, 0);
+			for (size_t v = 0; v < part.values.size(); ++v) {
+				remap[v + 1] = intern(part.values[v]);
+			}
 
-		for (size_t i=0 ; i<nodes.size() ; ++i) {
-			multichild_type& mchild = depths[nodes[i].children_depth];
-			auto it = lower_bound(mchild, nodes[i].self);
-			if (it == mchild.end() || it->first != nodes[i].self) {
-				it = mchild.insert(it, std::make_pair(nodes[i].self, std::vector<Count>()));
+			Count base = static_cast<Count>(nodes.size() - 1);
+			node_type& proot = part.nodes[0];
+			for (auto& ch : proot.children) {
+				nodes[0].children.push_back(std::make_pair(ch.first, ch.second + base));
 			}
-			it->second.push_back(i);
-			max_child = std::max(max_child, nodes[i].children.size());
-			for (auto& ch : nodes[i].children) {
-				parents[ch.second] = i;
+			nodes[0].num_terminals += proot.num_terminals;
+			nodes[0].children_depth = std::max(nodes[0].children_depth, proot.children_depth);
+
+			for (size_t i=1 ; i<part.nodes.size() ; ++i) {
+				nodes.push_back(std::move(part.nodes[i]));
+				nodes.back().value = remap[nodes.back().value];
+				for (auto& ch : nodes.back().children) {
+					ch.second += base;
+				}
 			}
 		}
 
-		std::cerr << "Compressing " << nodes.size() << " nodes..." << std::endl;
-		std::cerr << "Highest children count: " << max_child << std::endl;
-
-		size_t removed = 0;
-
-		for (auto& depth : depths) {
-			std::cerr << "Handling depth " << (&depth - &depths[0]) << "..." << std::flush;
+		children_type& roots = nodes[0].children;
+		std::sort(roots.begin(), roots.end());
+		for (size_t i=1 ; i<roots.size() ; ++i) {
+			if (roots[i].first == roots[i-1].first) {
+				clear();
+				throw std::runtime_error("stitch() was given parts that share a first code unit");
+			}
+		}
 
-			bool did_compress = false;
+		if (minimize(verbose)) {
+			was_compressed = true;
+		}
+		renumber_preorder();
+		// The moved nodes may still be views into the parts' storage, so only let go of the parts once everything is repacked here
+		freeze();
+		compressed = was_compressed;
+		for (auto& part : parts) {
+			part.clear();
+		}
+	}
 
-			for (auto& mchildren : depth) {
-				auto& mchild = mchildren.second;
+private:
+	// Merges all nodes with the same right language; works on plain tries as well as partially shared DAGs. Returns whether anything was merged.
+	bool minimize(bool verbose) {
+		// Visit nodes bottom-up by depth, and in index order within a depth, so children are canonical before their parents are looked up
+		std::vector<Count> offsets(nodes[0].children_depth + 2, 0);
+		size_t max_child = 0;
+		for (size_t i=0 ; i<nodes.size() ; ++i) {
+			++offsets[nodes[i].children_depth + 1];
+			max_child = std::max(max_child, nodes[i].children.size());
+		}
+		for (size_t d=1 ; d<offsets.size() ; ++d) {
+			offsets[d] += offsets[d-1];
+		}
+		std::vector<Count> order(nodes.size());
+		for (size_t i=0 ; i<nodes.size() ; ++i) {
+			order[offsets[nodes[i].children_depth]++] = static_cast<Count>(i);
+		}
 
-				for (auto onode = mchild.begin(); onode != mchild.end(); ++onode) {
-					if (*onode == 0) {
-						continue;
-					}
-					node_type *first = &nodes[*onode];
+		if (verbose) {
+			std::cerr << "Compressing " << nodes.size() << " nodes..." << std::endl;
+			std::cerr << "Highest children count: " << max_child << std::endl;
+		}
 
-					for (auto inode = onode + 1; inode != mchild.end(); ++inode) {
-						if (*inode == 0) {
-							continue;
-						}
-						node_type *second = &nodes[*inode];
-						if (parents[*inode] == std::numeric_limits<Count>::max() || !first->equals(*this, second)) {
-							continue;
-						}
+		std::vector<Count> canon(nodes.size());
+		hash_register_type uniques(nodes.size(), register_hash(&nodes), register_equal(&nodes));
+		size_t removed = 0;
 
-						findchild(nodes[parents[*inode]].children, first->self)->second = static_cast<Count>(first - &nodes[0]);
-						parents[*inode] = std::numeric_limits<Count>::max();
-						second->self = typename String::value_type();
-						second->children.clear();
-						second->children_depth = 0;
-						*inode = 0;
-						did_compress = true;
-						++removed;
-					}
-				}
+		for (size_t o=0 ; o<order.size() ; ++o) {
+			Count i = order[o];
+			for (auto& ch : nodes[i].children) {
+				ch.second = canon[ch.second];
 			}
+			auto ins = uniques.insert(i);
+			canon[i] = *ins.first;
+			if (!ins.second) {
+				++removed;
+			}
+		}
 
-			if (did_compress) {
-				compressed = true;
-				std::cerr << "compressed down to " << nodes.size()-removed << " nodes." << std::endl;
+		if (verbose) {
+			if (removed) {
+				std::cerr << "Compressed down to " << nodes.size()-removed << " nodes." << std::endl;
 			}
 			else {
-				std::cerr << "nothing more to do." << std::endl;
-				break;
+				std::cerr << "Nothing to compress." << std::endl;
 			}
 		}
+		uniques.clear();
 
-		std::map<Count,Count> oldnew;
-		oldnew[std::numeric_limits<Count>::max()] = std::numeric_limits<Count>::max();
+		std::vector<Count> oldnew(nodes.size(), std::numeric_limits<Count>::max());
 		node_container_type tosave;
 		tosave.reserve(nodes.size()-removed);
 
 		for (Count i=0 ; i<nodes.size() ; ++i) {
-			if (parents[i] != std::numeric_limits<Count>::max() || nodes[i].self != typename String::value_type()
-				|| nodes[i].children.size() != 0 || nodes[i].children_depth != 0) {
+			if (canon[i] == i) {
 				oldnew[i] = static_cast<Count>(tosave.size());
-				tosave.push_back(nodes[i]);
+				tosave.push_back(std::move(nodes[i]));
 			}
 		}
 
@@ -766,7 +2437,10 @@ public:
 				nodes[i].children[c].second = oldnew[nodes[i].children[c].second];
 			}
 		}
-		std::cerr << std::endl;
+		if (verbose) {
+			std::cerr << std::endl;
+		}
+		return removed != 0;
 	}
 };
 
@@ -0,0 +1,659 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef TDC_TRIE_COMPACT_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+#define TDC_TRIE_COMPACT_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+
+#include <tdc_trie_mmap.hpp>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace tdc {
+
+const uint32_t TRIE_COMPACT_SERIALIZED_REVISION = 10552;
+
+// LEB128: 7 bits per byte, lowest group first, high bit set on all but the last byte
+inline size_t varint_size(uint32_t v) {
+	size_t rv = 1;
+	for (; v >= 0x80; v >>= 7) {
+		++rv;
+	}
+	return rv;
+}
+
+inline char *write_varint(char *p, uint32_t v) {
+	for (; v >= 0x80; v >>= 7) {
+		*p++ = static_cast<char>(v | 0x80);
+	}
+	*p++ = static_cast<char>(v);
+	return p;
+}
+
+// Nearly every field is below 128, so the single byte case is kept apart and branch predicted
+inline const char *read_varint(const char *p, uint32_t& v) {
+	uint8_t b = static_cast<uint8_t>(*p++);
+	if (b < 0x80) {
+		v = b;
+		return p;
+	}
+	v = b & 0x7F;
+	for (unsigned shift = 7; ; shift += 7) {
+		b = static_cast<uint8_t>(*p++);
+		v |= static_cast<uint32_t>(b & 0x7F) << shift;
+		if (b < 0x80) {
+			return p;
+		}
+	}
+}
+
+// Whether d fits in a signed integer of w bytes
+inline bool fits_signed(int64_t d, size_t w) {
+	int64_t lim = static_cast<int64_t>(1) << (8*w - 1);
+	return d >= -lim && d < lim;
+}
+
+/*
+Compact layout; all fields are little-endian:
+	"TRCP" magic
+	uint32_t revision
+	uint16_t code unit width
+	uint16_t compressed flag
+	uint32_t number of nodes
+	uint32_t offset of the node records
+	uint32_t size of the node records
+	uint32_t checksum() of the node records
+Followed by the node records, and 3 zero bytes so a child slot can always be loaded as a whole uint32_t.
+A node record is the uint16_t label, a varint head of number of children << 3 | (slot width - 1) << 1 | 1 if terminal, a varint num_terminals,
+the unpadded label of each child as a code unit of the stored width, and then a slot for each child. A slot is the child's record offset minus
+this record's offset, as a signed integer of 1 to 4 bytes; each record uses the narrowest width that holds all its slots. Records are written in
+preorder of first visit, so most children follow shortly after their parent and need only 1 or 2 bytes.
+*/
+struct trie_compact_header {
+	uint32_t revision;
+	uint16_t width;
+	uint16_t compressed;
+	uint32_t num_nodes;
+	uint32_t nodes_offset;
+	uint32_t nodes_size;
+	uint32_t checksum;
+
+	static size_t size() {
+		return 4 + sizeof(uint32_t) + 2*sizeof(uint16_t) + 4*sizeof(uint32_t);
+	}
+
+	char *write(char *p) const {
+		memcpy(p, "TRCP", 4);
+		p += 4;
+		p = ::tdc::write(p, revision);
+		p = ::tdc::write(p, width);
+		p = ::tdc::write(p, compressed);
+		p = ::tdc::write(p, num_nodes);
+		p = ::tdc::write(p, nodes_offset);
+		p = ::tdc::write(p, nodes_size);
+		p = ::tdc::write(p, checksum);
+		return p;
+	}
+
+	// Parses and validates a header from the first n bytes of p, throwing on anything that does not fit
+	void read(const char *p, size_t n, uint16_t expect_width) {
+		if (n < size() || memcmp(p, "TRCP", 4)) {
+			throw std::runtime_error("Compact data did not start with magic byte sequence TRCP");
+		}
+		p += 4;
+		::tdc::read(p, revision);
+		p += sizeof(revision);
+		if (revision != TRIE_COMPACT_SERIALIZED_REVISION) {
+			char _msg[] = "Compact expected revision %u but data had revision %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, TRIE_COMPACT_SERIALIZED_REVISION, revision));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, width);
+		p += sizeof(width);
+		if (width != expect_width) {
+			char _msg[] = "Compact expected code unit width %u but data had width %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, expect_width, width));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, compressed);
+		p += sizeof(compressed);
+		uint32_t *fields[] = { &num_nodes, &nodes_offset, &nodes_size, &checksum };
+		for (auto field : fields) {
+			::tdc::read(p, *field);
+			p += sizeof(uint32_t);
+		}
+
+		if (num_nodes == 0 || nodes_offset < size() || static_cast<size_t>(nodes_offset) + nodes_size + sizeof(uint32_t) - 1 > n) {
+			throw std::runtime_error("Compact section sizes do not match the data; the file is truncated or corrupt");
+		}
+	}
+};
+
+inline bool is_trie_compact(const char *fname) {
+	return has_magic(fname, "TRCP");
+}
+
+inline bool is_trie_compact(const char *p, size_t n) {
+	return has_magic(p, n, "TRCP");
+}
+
+// Lays out a trie as variable width records, picking slot widths so every child offset delta fits
+template<typename String, typename Count>
+class trie_compact_builder {
+private:
+	typedef trie<String, Count> trie_type;
+
+	const trie_type& t;
+	std::vector<Count> order;
+	std::vector<uint32_t> ofs;
+	std::vector<uint8_t> widths;
+	size_t nodes_size;
+
+	size_t record_size(Count n) const {
+		const typename trie_type::node_type& node = t.nodes[n];
+		size_t c = node.children.size();
+		return sizeof(uint16_t) + varint_size(static_cast<uint32_t>(c << 3 | (widths[n] - 1) << 1 | 1)) + varint_size(node.num_terminals)
+			+ c*sizeof(typename String::value_type) + c*widths[n];
+	}
+
+public:
+	trie_compact_builder(const trie_type& t) :
+		t(t),
+		nodes_size(0)
+	{
+		const typename trie_type::node_container_type& nodes = t.nodes;
+
+		std::vector<bool> seen(nodes.size(), false);
+		std::vector<std::pair<Count, size_t> > stack(1, std::make_pair(static_cast<Count>(0), static_cast<size_t>(0)));
+		seen[0] = true;
+		order.push_back(0);
+		while (!stack.empty()) {
+			std::pair<Count, size_t>& top = stack.back();
+			if (top.second == nodes[top.first].children.size()) {
+				stack.pop_back();
+				continue;
+			}
+			Count c = nodes[top.first].children[top.second++].second;
+			if (!seen[c]) {
+				seen[c] = true;
+				order.push_back(c);
+				stack.push_back(std::make_pair(c, static_cast<size_t>(0)));
+			}
+		}
+
+		// Start from the widest slots and narrow them until nothing changes. Narrowing only ever shrinks records, so the distance
+		// between any two records, and with it the width each record needs, never grows and this settles after a few rounds.
+		ofs.resize(nodes.size(), 0);
+		widths.resize(nodes.size(), 4);
+		for (bool changed = true; changed;) {
+			size_t at = trie_compact_header::size();
+			for (auto n : order) {
+				if (at > std::numeric_limits<uint32_t>::max()) {
+					throw std::runtime_error("Compact trie would be larger than 4 GiB");
+				}
+				ofs[n] = static_cast<uint32_t>(at);
+				at += record_size(n);
+			}
+			nodes_size = at - trie_compact_header::size();
+
+			changed = false;
+			for (auto n : order) {
+				uint8_t w = 1;
+				for (auto& ch : nodes[n].children) {
+					int64_t d = static_cast<int64_t>(ofs[ch.second]) - ofs[n];
+					while (!fits_signed(d, w)) {
+						++w;
+					}
+				}
+				if (w != widths[n]) {
+					widths[n] = w;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	size_t size() const {
+		return order.size();
+	}
+
+	size_t serialized_size() const {
+		return trie_compact_header::size() + nodes_size + sizeof(uint32_t) - 1;
+	}
+
+	// Serializes into buf, which must hold serialized_size() bytes
+	void serialize(char *buf) const {
+		char *p = buf + trie_compact_header::size();
+		for (auto n : order) {
+			const typename trie_type::node_type& node = t.nodes[n];
+			uint32_t c = static_cast<uint32_t>(node.children.size());
+			p = write(p, static_cast<uint16_t>(node.self));
+			p = write_varint(p, c << 3 | static_cast<uint32_t>(widths[n] - 1) << 1 | (node.terminal ? 1 : 0));
+			p = write_varint(p, node.num_terminals);
+			for (auto& ch : node.children) {
+				p = write(p, ch.first);
+			}
+			for (auto& ch : node.children) {
+				uint32_t d = bswap(static_cast<uint32_t>(ofs[ch.second] - ofs[n]));
+				memcpy(p, &d, widths[n]);
+				p += widths[n];
+			}
+		}
+		memset(p, 0, sizeof(uint32_t) - 1);
+
+		trie_compact_header hdr;
+		hdr.revision = TRIE_COMPACT_SERIALIZED_REVISION;
+		hdr.width = sizeof(typename String::value_type);
+		hdr.compressed = t.compressed;
+		hdr.num_nodes = static_cast<uint32_t>(order.size());
+		hdr.nodes_offset = static_cast<uint32_t>(trie_compact_header::size());
+		hdr.nodes_size = static_cast<uint32_t>(nodes_size);
+		hdr.checksum = checksum(buf + hdr.nodes_offset, hdr.nodes_size);
+		hdr.write(buf);
+	}
+
+	void serialize(std::ostream& out) const {
+		std::vector<char> buf(serialized_size());
+		serialize(buf.data());
+		out.write(buf.data(), buf.size());
+	}
+};
+
+/*
+Read-only view of a compact trie written by trie_compact_builder, with the same interface as trie_mmap.
+Nodes are identified by the file offset of their record; npos (0) is the root as an argument, and no such node as a result.
+Each step decodes two varints, which are a single byte for all but the widest nodes, and then searches the inline labels as trie_mmap does.
+*/
+template<typename String=u16string, typename Count=uint32_t>
+class trie_compact {
+private:
+	typedef typename String::value_type unit_type;
+
+	// The decoded fixed part of a record
+	struct record {
+		// Labels are packed at any byte offset, so they are only ever loaded with memcpy, see label_at()
+		const char *labels;
+		const char *slots;
+		uint32_t num_children;
+		uint32_t width;
+		bool terminal;
+	};
+
+	trie_compact_header hdr;
+	trie_mapping map;
+
+	const char *data() const {
+		return map.data();
+	}
+
+	void load() {
+		hdr.read(data(), map.size(), sizeof(typename String::value_type));
+	}
+
+	Count resolve(size_t n) const {
+		return (n == npos) ? static_cast<Count>(hdr.nodes_offset) : static_cast<Count>(n);
+	}
+
+	record decode(Count n) const {
+		record rv;
+		uint32_t head = 0, nt = 0;
+		const char *p = read_varint(data() + n + sizeof(uint16_t), head);
+		p = read_varint(p, nt);
+		rv.num_children = head >> 3;
+		rv.width = ((head >> 1) & 3) + 1;
+		rv.terminal = (head & 1) != 0;
+		rv.labels = p;
+		rv.slots = p + rv.num_children*sizeof(unit_type);
+		return rv;
+	}
+
+	static unit_type label_at(const record& r, size_t i) {
+		return read<unit_type>(r.labels + i*sizeof(unit_type));
+	}
+
+	// Index of the child labelled y, or num_children; a scan for narrow nodes and a lower bound for wide ones, as findlabel() does
+	static size_t find_label(const record& r, unit_type y) {
+		size_t n = r.num_children;
+		if (n <= 64) {
+			for (size_t i = 0; i < n; ++i) {
+				if (label_at(r, i) == y) {
+					return i;
+				}
+			}
+			return n;
+		}
+		size_t lo = 0;
+		for (size_t len = n; len > 0;) {
+			size_t half = len / 2;
+			if (label_at(r, lo + half) < y) {
+				lo += half + 1;
+				len -= half + 1;
+			}
+			else {
+				len = half;
+			}
+		}
+		return (lo < n && label_at(r, lo) == y) ? lo : n;
+	}
+
+	// Sign extends the slot of child i from its stored width
+	Count child_at(Count n, const record& r, size_t i) const {
+		unsigned shift = 32 - 8*r.width;
+		int32_t d = static_cast<int32_t>(read<uint32_t>(r.slots + i*r.width) << shift) >> shift;
+		return static_cast<Count>(static_cast<int64_t>(n) + d);
+	}
+
+	bool terminal(Count n) const {
+		uint32_t head = 0;
+		read_varint(data() + n + sizeof(uint16_t), head);
+		return (head & 1) != 0;
+	}
+
+	typename String::value_type self(Count n) const {
+		return static_cast<unit_type>(read<uint16_t>(data() + n));
+	}
+
+	Count num_terminals(Count n) const {
+		uint32_t head = 0, nt = 0;
+		read_varint(read_varint(data() + n + sizeof(uint16_t), head), nt);
+		return static_cast<Count>(nt);
+	}
+
+	Count child(Count n, typename String::value_type c) const {
+		record r = decode(n);
+		size_t i = find_label(r, c);
+		return (i == r.num_children) ? static_cast<Count>(npos) : child_at(n, r, i);
+	}
+
+	// word holds the labels on the path to k, and state is the automaton's state after them; the states below follow it
+	template<typename Sink>
+	void query(Count k, const levenshtein_automaton<String>& la, uint64_t *state, String& word, size_t maxdist, Sink& sink) const {
+		record r = decode(k);
+
+		if (r.terminal) {
+			size_t dist = la.distance(state);
+			if (dist <= maxdist) {
+				sink(static_cast<const String&>(word), dist);
+			}
+		}
+
+		uint64_t *below = state + la.state_size();
+		for (size_t i = 0; i != r.num_children; ++i) {
+			typename String::value_type label = label_at(r, i);
+			if (la.step(state, below, label)) {
+				word.push_back(label);
+				query(child_at(k, r, i), la, below, word, maxdist, sink);
+				word.pop_back();
+			}
+		}
+	}
+
+public:
+	class const_iterator {
+	private:
+		friend class trie_compact;
+		const trie_compact *owner;
+		std::vector<Count> path;
+
+		void descend(Count n) {
+			for (;;) {
+				record r = owner->decode(n);
+				if (r.num_children == 0) {
+					break;
+				}
+				n = owner->child_at(n, r, 0);
+				path.push_back(n);
+			}
+		}
+
+	public:
+		const_iterator(const trie_compact *owner = 0) :
+		owner(owner)
+		{
+		}
+
+		const_iterator(const trie_compact *owner, Count n) :
+		owner(owner),
+		path(1, owner->resolve(n))
+		{
+			if (!owner->terminal(path.back())) {
+				descend(path.back());
+			}
+		}
+
+		String operator*() const {
+			String rv;
+			rv.reserve(path.size());
+			for (size_t i = 1; i<path.size(); ++i) {
+				rv += owner->self(path[i]);
+			}
+			return rv;
+		}
+
+		bool operator==(const const_iterator& o) const {
+			return owner == o.owner && path == o.path;
+		}
+
+		bool operator!=(const const_iterator& o) const {
+			return !(*this == o);
+		}
+
+		const_iterator& operator++() {
+			while (!path.empty()) {
+				Count old = path.back();
+				path.pop_back();
+
+				if (path.empty()) {
+					break;
+				}
+
+				Count parent = path.back();
+				record r = owner->decode(parent);
+				size_t i = find_label(r, owner->self(old)) + 1;
+				if (i < r.num_children) {
+					Count n = owner->child_at(parent, r, i);
+					path.push_back(n);
+					descend(n);
+					break;
+				}
+				if (r.terminal) {
+					break;
+				}
+			}
+			return *this;
+		}
+	};
+
+	class browser {
+	private:
+		const trie_compact *owner;
+		Count node;
+
+	public:
+		class browser_out {
+		private:
+			const trie_compact *owner;
+			Count node;
+
+		public:
+			browser_out(const trie_compact *owner = 0, Count node = npos) :
+				owner(owner),
+				node(node) {
+			}
+
+			const_iterator begin() const {
+				return const_iterator(owner, node);
+			}
+
+			const_iterator end() const {
+				return const_iterator(owner);
+			}
+		};
+
+		class browser_iter {
+		private:
+			const trie_compact *owner;
+			Count node;
+			Count which;
+
+		public:
+			browser_iter(const trie_compact *owner = 0, Count node = npos, Count which = 0) :
+				owner(owner),
+				node(node),
+				which(which) {
+			}
+
+			browser_out values() const {
+				return browser_out(owner, owner->child_at(node, owner->decode(node), which));
+			}
+
+			std::pair<typename String::value_type, Count> operator*() const {
+				record r = owner->decode(node);
+				Count c = owner->child_at(node, r, which);
+				return std::make_pair(static_cast<typename String::value_type>(label_at(r, which)), owner->num_terminals(c));
+			}
+
+			bool operator==(const browser_iter& o) {
+				return (owner == o.owner) && (node == o.node) && (which == o.which);
+			}
+
+			bool operator!=(const browser_iter& o) {
+				return !(*this == o);
+			}
+
+			browser_iter& operator++() {
+				++which;
+				return *this;
+			}
+		};
+
+		browser(const trie_compact *owner = 0, Count node = npos) :
+			owner(owner),
+			node(owner->resolve(node)) {
+		}
+
+		browser_iter begin() const {
+			return browser_iter(owner, node, 0);
+		}
+
+		browser_iter end() const {
+			return browser_iter(owner, node, owner->decode(node).num_children);
+		}
+	};
+
+	friend class const_iterator;
+	friend class browser;
+
+	typedef std::map<String,size_t> query_type;
+	typedef std::pair<size_t,bool> traverse_type;
+	typedef String value_type;
+	enum {
+		npos = static_cast<Count>(0)
+	};
+
+	trie_compact(const char *fname, const map_options& opts = map_options()) :
+		map(fname, opts)
+	{
+		load();
+	}
+
+	// Reads a trie that is already in memory, such as one embedded in the binary or received over the network; buf must outlive this
+	trie_compact(const char *buf, size_t n, const map_options& opts = map_options()) :
+		map(buf, n, opts)
+	{
+		load();
+	}
+
+	// Checks the stored checksum, which means reading the whole file
+	bool verify() const {
+		return checksum(data() + hdr.nodes_offset, hdr.nodes_size) == hdr.checksum;
+	}
+
+	size_t size() const {
+		return hdr.num_nodes;
+	}
+
+	const_iterator begin() const {
+		return const_iterator(this, npos);
+	}
+
+	const_iterator end() const {
+		return const_iterator(this);
+	}
+
+	query_type query(const String& entry, size_t maxdist = 0) const {
+		query_type matches;
+		query(entry, maxdist, [&](const String& word, size_t dist) {
+			matches.insert(std::make_pair(word, dist));
+		});
+		return matches;
+	}
+
+	// Calls sink(word, dist) for each word within maxdist edits of entry, as trie_mmap::query() does; word is only valid during the call
+	template<typename Sink>
+	void query(const String& entry, size_t maxdist, Sink&& sink) const {
+		search_within<levenshtein_automaton<String>>(entry, maxdist, [&](const levenshtein_automaton<String>& la, uint64_t *states, String& word) {
+			query(resolve(npos), la, states, word, maxdist, sink);
+		});
+	}
+
+	const_iterator find(const String& entry) const {
+		if (entry.empty()) {
+			return end();
+		}
+		const_iterator rv(this);
+		rv.path.reserve(entry.size() + 1);
+		rv.path.push_back(resolve(npos));
+		for (size_t i=0 ; i<entry.size() ; ++i) {
+			Count k = child(rv.path.back(), entry[i]);
+			if (k == npos) {
+				return end();
+			}
+			rv.path.push_back(k);
+		}
+		if (!terminal(rv.path.back())) {
+			return end();
+		}
+		return rv;
+	}
+
+	traverse_type traverse(typename String::value_type c, size_t n=npos) const {
+		Count k = child(resolve(n), c);
+		return traverse_type(k, k != npos && terminal(k));
+	}
+
+	traverse_type traverse_end() const {
+		traverse_type rv(npos, false);
+		return rv;
+	}
+
+	browser browse(size_t n=npos) const {
+		return browser(this, static_cast<Count>(n));
+	}
+};
+}
+
+#endif
@@ -0,0 +1,768 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef TDC_TRIE_DA_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+#define TDC_TRIE_DA_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+
+#include <tdc_trie.hpp>
+#include <tdc_trie_mapping.hpp>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace tdc {
+
+const uint32_t TRIE_DA_SERIALIZED_REVISION = 10549;
+
+/*
+Double-array layout; all fields are little-endian:
+	"TRDA" magic
+	uint32_t revision
+	uint16_t code unit width
+	uint16_t compressed flag
+	uint32_t number of states
+	uint32_t number of codes, including the unused code 0
+	uint32_t number of slots
+	uint32_t offset of the code table, uint16_t code of each of the 65536 labels, 0 for labels that never occur
+	uint32_t offset of the label table, uint16_t label of each code, padded to a multiple of 4 bytes
+	uint32_t offset of the state records
+	uint32_t offset of the slot records
+	uint32_t checksum() of everything from the code table to the end of the slots
+A state record is Count num_terminals, uint16_t code of the first child in label order or 0, uint16_t 0.
+A slot record is the transition into a state: uint16_t check, uint16_t code of the next sibling in label order or 0, Count base of the target state,
+and Count target state << 1 | target terminal flag. Slot 0 is the way into the root, state 0, and has check 0 so no lookup ever matches it.
+The child with code c of the state entered through slot t is in slot base(t) + c, and is valid iff that slot's check is c. Every state with children
+has its own base, so no other state can own a slot with the same check there; childless states have base 0, which no state with children uses.
+There are always at least base + number of codes slots, so the lookup never needs a bounds check.
+*/
+struct trie_da_header {
+	uint32_t revision;
+	uint16_t width;
+	uint16_t compressed;
+	uint32_t num_states;
+	uint32_t num_codes;
+	uint32_t num_slots;
+	uint32_t codes_offset;
+	uint32_t labels_offset;
+	uint32_t states_offset;
+	uint32_t slots_offset;
+	uint32_t checksum;
+
+	static size_t size() {
+		return 4 + sizeof(uint32_t) + 2*sizeof(uint16_t) + 8*sizeof(uint32_t);
+	}
+
+	char *write(char *p) const {
+		memcpy(p, "TRDA", 4);
+		p += 4;
+		p = ::tdc::write(p, revision);
+		p = ::tdc::write(p, width);
+		p = ::tdc::write(p, compressed);
+		p = ::tdc::write(p, num_states);
+		p = ::tdc::write(p, num_codes);
+		p = ::tdc::write(p, num_slots);
+		p = ::tdc::write(p, codes_offset);
+		p = ::tdc::write(p, labels_offset);
+		p = ::tdc::write(p, states_offset);
+		p = ::tdc::write(p, slots_offset);
+		p = ::tdc::write(p, checksum);
+		return p;
+	}
+
+	// Parses and validates a header from the first n bytes of p, throwing on anything that does not fit
+	void read(const char *p, size_t n, uint16_t expect_width, size_t state_size, size_t slot_size) {
+		if (n < size() || memcmp(p, "TRDA", 4)) {
+			throw std::runtime_error("Double-array data did not start with magic byte sequence TRDA");
+		}
+		p += 4;
+		::tdc::read(p, revision);
+		p += sizeof(revision);
+		if (revision != TRIE_DA_SERIALIZED_REVISION) {
+			char _msg[] = "Double-array expected revision %u but data had revision %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, TRIE_DA_SERIALIZED_REVISION, revision));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, width);
+		p += sizeof(width);
+		if (width != expect_width) {
+			char _msg[] = "Double-array expected code unit width %u but data had width %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, expect_width, width));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, compressed);
+		p += sizeof(compressed);
+		uint32_t *fields[] = { &num_states, &num_codes, &num_slots, &codes_offset, &labels_offset, &states_offset, &slots_offset, &checksum };
+		for (auto field : fields) {
+			::tdc::read(p, *field);
+			p += sizeof(uint32_t);
+		}
+
+		if (num_states == 0 || num_codes == 0 || num_codes > 65536 || num_slots < num_codes
+			|| codes_offset < size() || static_cast<size_t>(codes_offset) + 65536*sizeof(uint16_t) > labels_offset
+			|| static_cast<size_t>(labels_offset) + num_codes*sizeof(uint16_t) > states_offset
+			|| static_cast<size_t>(states_offset) + num_states*state_size > slots_offset
+			|| static_cast<size_t>(slots_offset) + num_slots*slot_size > n) {
+			throw std::runtime_error("Double-array section sizes do not match the data; the file is truncated or corrupt");
+		}
+	}
+};
+
+inline bool is_trie_da(const char *fname) {
+	return has_magic(fname, "TRDA");
+}
+
+inline bool is_trie_da(const char *p, size_t n) {
+	return has_magic(p, n, "TRDA");
+}
+
+/*
+Lays out a trie as a double array. Labels are mapped to dense codes by descending edge frequency, so common labels have small codes and
+the child slots of most states fall close together. States are placed in breadth-first order at the first free base that fits all their children.
+*/
+template<typename String, typename Count>
+class trie_da_builder {
+private:
+	typedef trie<String, Count> trie_type;
+
+	static constexpr size_t state_size = sizeof(Count) + 2*sizeof(uint16_t);
+	static constexpr size_t slot_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + sizeof(Count);
+	// Free slots that fail this many placements are dropped from the free list, which bounds the search on large inputs at the cost of a few holes
+	static constexpr uint8_t max_fails = 16;
+	static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+	struct state {
+		Count base;
+		Count num_terminals;
+		uint16_t first;
+	};
+
+	bool compressed;
+	std::vector<uint16_t> codes;
+	std::vector<uint16_t> labels;
+	std::vector<state> states;
+	std::vector<uint16_t> check;
+	std::vector<uint16_t> next;
+	// Target state of each slot; its base and terminal flag are added when serializing
+	std::vector<Count> target;
+	std::vector<bool> terminal;
+	size_t transitions;
+
+	// Doubly linked list of free slots, with the number of failed placements at each
+	std::vector<uint32_t> free_next;
+	std::vector<uint32_t> free_prev;
+	std::vector<uint8_t> fails;
+	std::vector<bool> used_base;
+	uint32_t free_head, free_tail;
+
+	void extend(size_t n) {
+		size_t old = check.size();
+		if (n <= old) {
+			return;
+		}
+		if (n > std::numeric_limits<uint32_t>::max() / 2) {
+			throw std::runtime_error("Double-array would need more than 2^31 slots");
+		}
+		check.resize(n, 0);
+		next.resize(n, 0);
+		target.resize(n, 0);
+		terminal.resize(n, false);
+		free_next.resize(n, none);
+		free_prev.resize(n, none);
+		fails.resize(n, 0);
+		used_base.resize(n, false);
+		for (size_t i = old; i < n; ++i) {
+			free_prev[i] = free_tail;
+			if (free_tail == none) {
+				free_head = static_cast<uint32_t>(i);
+			}
+			else {
+				free_next[free_tail] = static_cast<uint32_t>(i);
+			}
+			free_tail = static_cast<uint32_t>(i);
+		}
+	}
+
+	void unlink(size_t i) {
+		if (free_prev[i] == none) {
+			free_head = free_next[i];
+		}
+		else {
+			free_next[free_prev[i]] = free_next[i];
+		}
+		if (free_next[i] == none) {
+			free_tail = free_prev[i];
+		}
+		else {
+			free_prev[free_next[i]] = free_prev[i];
+		}
+		free_next[i] = free_prev[i] = none;
+	}
+
+	bool fits(size_t b, const std::vector<uint16_t>& cs) {
+		if (b == 0 || used_base[b]) {
+			return false;
+		}
+		extend(b + cs.back() + 1);
+		for (auto c : cs) {
+			if (check[b + c] != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Finds a base where every code in cs, which is sorted, lands on a free slot
+	size_t find_base(const std::vector<uint16_t>& cs) {
+		uint32_t f = free_head;
+		for (;;) {
+			if (f == none) {
+				size_t old = check.size();
+				extend(old + cs.back() + 1);
+				f = static_cast<uint32_t>(old);
+			}
+			if (f > cs.front() && fits(f - cs.front(), cs)) {
+				return f - cs.front();
+			}
+			uint32_t n = free_next[f];
+			if (++fails[f] >= max_fails) {
+				unlink(f);
+			}
+			f = n;
+		}
+	}
+
+public:
+	trie_da_builder(const trie_type& t) :
+		compressed(t.compressed),
+		codes(65536, 0),
+		transitions(0),
+		free_head(none),
+		free_tail(none)
+	{
+		const typename trie_type::node_container_type& nodes = t.nodes;
+
+		std::vector<std::pair<size_t, uint16_t> > freq(65536);
+		for (size_t i = 0; i < freq.size(); ++i) {
+			freq[i].second = static_cast<uint16_t>(i);
+		}
+		for (auto& node : nodes) {
+			for (auto& ch : node.children) {
+				++freq[static_cast<uint16_t>(ch.first)].first;
+			}
+		}
+		std::stable_sort(freq.begin(), freq.end(), [](const std::pair<size_t, uint16_t>& a, const std::pair<size_t, uint16_t>& b) {
+			return a.first > b.first;
+		});
+		labels.push_back(0);
+		for (auto& f : freq) {
+			if (f.first == 0) {
+				break;
+			}
+			if (labels.size() == 65536) {
+				throw std::runtime_error("Double-array can hold at most 65535 distinct labels");
+			}
+			codes[f.second] = static_cast<uint16_t>(labels.size());
+			labels.push_back(f.second);
+		}
+
+		// Number states breadth-first, so a state's children are placed soon after it
+		std::vector<Count> order(1, 0);
+		std::vector<Count> ids(nodes.size(), std::numeric_limits<Count>::max());
+		ids[0] = 0;
+		for (size_t i = 0; i < order.size(); ++i) {
+			for (auto& ch : nodes[order[i]].children) {
+				if (ids[ch.second] == std::numeric_limits<Count>::max()) {
+					ids[ch.second] = static_cast<Count>(order.size());
+					order.push_back(ch.second);
+				}
+			}
+		}
+		if (order.size() > std::numeric_limits<uint32_t>::max() / 2) {
+			throw std::runtime_error("Double-array can hold at most 2^31 states");
+		}
+
+		extend(labels.size());
+		unlink(0);
+		used_base[0] = true;
+		terminal[0] = nodes[0].terminal;
+		states.resize(order.size());
+		std::vector<uint16_t> cs;
+		for (size_t s = 0; s < order.size(); ++s) {
+			const typename trie_type::node_type& node = nodes[order[s]];
+			state& st = states[s];
+			st.base = 0;
+			st.num_terminals = node.num_terminals;
+			st.first = 0;
+			if (node.children.empty()) {
+				continue;
+			}
+
+			cs.clear();
+			for (auto& ch : node.children) {
+				cs.push_back(codes[static_cast<uint16_t>(ch.first)]);
+			}
+			std::sort(cs.begin(), cs.end());
+			size_t b = find_base(cs);
+			used_base[b] = true;
+			st.base = static_cast<Count>(b);
+			st.first = codes[static_cast<uint16_t>(node.children.front().first)];
+
+			for (size_t c = 0; c < node.children.size(); ++c) {
+				uint16_t code = codes[static_cast<uint16_t>(node.children[c].first)];
+				++transitions;
+				unlink(b + code);
+				check[b + code] = code;
+				next[b + code] = (c + 1 < node.children.size()) ? codes[static_cast<uint16_t>(node.children[c+1].first)] : 0;
+				target[b + code] = ids[node.children[c].second];
+				terminal[b + code] = nodes[node.children[c].second].terminal;
+			}
+		}
+
+		// Leave room for any code past the highest base, so lookups need no bounds check
+		size_t max_base = 0;
+		for (auto& st : states) {
+			max_base = std::max(max_base, static_cast<size_t>(st.base));
+		}
+		size_t n = max_base + labels.size();
+		extend(n);
+		check.resize(n);
+		next.resize(n);
+		target.resize(n);
+		terminal.resize(n);
+		std::vector<uint32_t>().swap(free_next);
+		std::vector<uint32_t>().swap(free_prev);
+		std::vector<uint8_t>().swap(fails);
+		std::vector<bool>().swap(used_base);
+	}
+
+	size_t num_slots() const {
+		return check.size();
+	}
+
+	size_t num_transitions() const {
+		return transitions;
+	}
+
+	size_t serialized_size() const {
+		size_t lsize = (labels.size() + (labels.size() & 1))*sizeof(uint16_t);
+		return trie_da_header::size() + codes.size()*sizeof(uint16_t) + lsize + states.size()*state_size + check.size()*slot_size;
+	}
+
+	// Serializes into buf, which must hold serialized_size() bytes
+	void serialize(char *buf) const {
+		trie_da_header hdr;
+		hdr.revision = TRIE_DA_SERIALIZED_REVISION;
+		hdr.width = sizeof(typename String::value_type);
+		hdr.compressed = compressed;
+		hdr.num_states = static_cast<uint32_t>(states.size());
+		hdr.num_codes = static_cast<uint32_t>(labels.size());
+		hdr.num_slots = static_cast<uint32_t>(check.size());
+
+		char *p = buf + trie_da_header::size();
+		hdr.codes_offset = static_cast<uint32_t>(p - buf);
+		for (auto c : codes) {
+			p = write(p, c);
+		}
+		hdr.labels_offset = static_cast<uint32_t>(p - buf);
+		for (auto l : labels) {
+			p = write(p, l);
+		}
+		if (labels.size() & 1) {
+			p = write(p, static_cast<uint16_t>(0));
+		}
+		hdr.states_offset = static_cast<uint32_t>(p - buf);
+		for (auto& st : states) {
+			p = write(p, st.num_terminals);
+			p = write(p, st.first);
+			p = write(p, static_cast<uint16_t>(0));
+		}
+		hdr.slots_offset = static_cast<uint32_t>(p - buf);
+		for (size_t i = 0; i < check.size(); ++i) {
+			bool used = (i == 0 || check[i] != 0);
+			p = write(p, check[i]);
+			p = write(p, next[i]);
+			p = write(p, used ? states[target[i]].base : static_cast<Count>(0));
+			p = write(p, static_cast<Count>((target[i] << 1) | (terminal[i] ? 1 : 0)));
+		}
+
+		hdr.checksum = checksum(buf + hdr.codes_offset, p - buf - hdr.codes_offset);
+		hdr.write(buf);
+	}
+
+	void serialize(std::ostream& out) const {
+		std::vector<char> buf(serialized_size());
+		serialize(buf.data());
+		out.write(buf.data(), buf.size());
+	}
+};
+
+/*
+Read-only view of a double-array trie written by trie_da_builder, with the same interface as trie_mmap.
+Nodes are identified by the slot of the transition into them, which also holds their base, so each step down the trie is a code table lookup
+and a single slot load, independent of how many children the node has. npos (0) is the slot into the root; as a result it means there was no such node.
+*/
+template<typename String=u16string, typename Count=uint32_t>
+class trie_da {
+private:
+	static constexpr size_t state_size = sizeof(Count) + 2*sizeof(uint16_t);
+	static constexpr size_t slot_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + sizeof(Count);
+
+
+	trie_da_header hdr;
+	trie_mapping map;
+	const uint16_t *codes;
+	const uint16_t *labels;
+	const char *states;
+	const char *slots;
+
+	const char *data() const {
+		return map.data();
+	}
+
+	void load() {
+		hdr.read(data(), map.size(), sizeof(typename String::value_type), state_size, slot_size);
+		codes = reinterpret_cast<const uint16_t*>(data() + hdr.codes_offset);
+		labels = reinterpret_cast<const uint16_t*>(data() + hdr.labels_offset);
+		states = data() + hdr.states_offset;
+		slots = data() + hdr.slots_offset;
+	}
+
+	const char *slot(Count t) const {
+		return slots + static_cast<size_t>(t)*slot_size;
+	}
+
+	uint16_t check(Count t) const {
+		return bswap(*reinterpret_cast<const uint16_t*>(slot(t)));
+	}
+
+	uint16_t next(Count t) const {
+		return bswap(*reinterpret_cast<const uint16_t*>(slot(t) + sizeof(uint16_t)));
+	}
+
+	Count base(Count t) const {
+		return bswap(*reinterpret_cast<const Count*>(slot(t) + sizeof(uint16_t) + sizeof(uint16_t)));
+	}
+
+	Count target(Count t) const {
+		return bswap(*reinterpret_cast<const Count*>(slot(t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count)));
+	}
+
+	bool terminal(Count t) const {
+		return (target(t) & 1) != 0;
+	}
+
+	typename String::value_type self(Count t) const {
+		return bswap(labels[check(t)]);
+	}
+
+	Count num_terminals(Count t) const {
+		return bswap(*reinterpret_cast<const Count*>(states + static_cast<size_t>(target(t) >> 1)*state_size));
+	}
+
+	uint16_t first(Count t) const {
+		return bswap(*reinterpret_cast<const uint16_t*>(states + static_cast<size_t>(target(t) >> 1)*state_size + sizeof(Count)));
+	}
+
+	uint16_t code(typename String::value_type c) const {
+		if (static_cast<size_t>(c) > 0xFFFF) {
+			return 0;
+		}
+		return bswap(codes[static_cast<uint16_t>(c)]);
+	}
+
+	// Slot of the child of t labelled c, or npos
+	Count child(Count t, typename String::value_type c) const {
+		uint16_t k = code(c);
+		if (k == 0) {
+			return npos;
+		}
+		Count n = base(t) + k;
+		return (check(n) == k) ? n : static_cast<Count>(npos);
+	}
+
+	// word holds the labels on the path to t, and state is the automaton's state after them; the states below follow it
+	template<typename Sink>
+	void query(Count t, const levenshtein_automaton<String>& la, uint64_t *state, String& word, size_t maxdist, Sink& sink) const {
+		if (terminal(t)) {
+			size_t dist = la.distance(state);
+			if (dist <= maxdist) {
+				sink(static_cast<const String&>(word), dist);
+			}
+		}
+
+		uint64_t *below = state + la.state_size();
+		Count b = base(t);
+		for (uint16_t k = first(t); k != 0; k = next(b + k)) {
+			typename String::value_type label = bswap(labels[k]);
+			if (la.step(state, below, label)) {
+				word.push_back(label);
+				query(b + k, la, below, word, maxdist, sink);
+				word.pop_back();
+			}
+		}
+	}
+
+public:
+	class const_iterator {
+	private:
+		friend class trie_da;
+		const trie_da *owner;
+		std::vector<Count> path;
+
+		void descend(Count n) {
+			for (uint16_t k = owner->first(n); k != 0; k = owner->first(n)) {
+				n = owner->base(n) + k;
+				path.push_back(n);
+			}
+		}
+
+	public:
+		const_iterator(const trie_da *owner = 0) :
+		owner(owner)
+		{
+		}
+
+		const_iterator(const trie_da *owner, Count n) :
+		owner(owner),
+		path(1, n)
+		{
+			if (!owner->terminal(n)) {
+				descend(n);
+			}
+		}
+
+		String operator*() const {
+			String rv;
+			rv.reserve(path.size());
+			for (size_t i = 1; i<path.size(); ++i) {
+				rv += owner->self(path[i]);
+			}
+			return rv;
+		}
+
+		bool operator==(const const_iterator& o) const {
+			return owner == o.owner && path == o.path;
+		}
+
+		bool operator!=(const const_iterator& o) const {
+			return !(*this == o);
+		}
+
+		const_iterator& operator++() {
+			while (!path.empty()) {
+				Count old = path.back();
+				path.pop_back();
+
+				if (path.empty()) {
+					break;
+				}
+
+				uint16_t k = owner->next(old);
+				if (k) {
+					Count n = owner->base(path.back()) + k;
+					path.push_back(n);
+					descend(n);
+					break;
+				}
+				if (owner->terminal(path.back())) {
+					break;
+				}
+			}
+			return *this;
+		}
+	};
+
+	class browser {
+	private:
+		const trie_da *owner;
+		Count node;
+
+	public:
+		class browser_out {
+		private:
+			const trie_da *owner;
+			Count node;
+
+		public:
+			browser_out(const trie_da *owner = 0, Count node = npos) :
+				owner(owner),
+				node(node) {
+			}
+
+			const_iterator begin() const {
+				return const_iterator(owner, node);
+			}
+
+			const_iterator end() const {
+				return const_iterator(owner);
+			}
+		};
+
+		// Walks the children of node in label order; which is the slot of the current child, and npos past the last one
+		class browser_iter {
+		private:
+			const trie_da *owner;
+			Count node;
+			Count which;
+
+		public:
+			browser_iter(const trie_da *owner = 0, Count node = npos, Count which = npos) :
+				owner(owner),
+				node(node),
+				which(which) {
+			}
+
+			browser_out values() const {
+				return browser_out(owner, which);
+			}
+
+			std::pair<typename String::value_type, Count> operator*() const {
+				return std::make_pair(owner->self(which), owner->num_terminals(which));
+			}
+
+			bool operator==(const browser_iter& o) {
+				return (owner == o.owner) && (node == o.node) && (which == o.which);
+			}
+
+			bool operator!=(const browser_iter& o) {
+				return !(*this == o);
+			}
+
+			browser_iter& operator++() {
+				uint16_t k = owner->next(which);
+				which = k ? owner->base(node) + k : static_cast<Count>(npos);
+				return *this;
+			}
+		};
+
+		browser(const trie_da *owner = 0, Count node = npos) :
+			owner(owner),
+			node(node) {
+		}
+
+		browser_iter begin() const {
+			uint16_t k = owner->first(node);
+			return browser_iter(owner, node, k ? owner->base(node) + k : static_cast<Count>(npos));
+		}
+
+		browser_iter end() const {
+			return browser_iter(owner, node, npos);
+		}
+	};
+
+	friend class const_iterator;
+	friend class browser;
+
+	typedef std::map<String,size_t> query_type;
+	typedef std::pair<size_t,bool> traverse_type;
+	typedef String value_type;
+	enum {
+		npos = static_cast<Count>(0)
+	};
+
+	trie_da(const char *fname, const map_options& opts = map_options()) :
+		map(fname, opts)
+	{
+		load();
+	}
+
+	// Reads a trie that is already in memory, such as one embedded in the binary or received over the network; buf must outlive this
+	trie_da(const char *buf, size_t n, const map_options& opts = map_options()) :
+		map(buf, n, opts)
+	{
+		load();
+	}
+
+	// Checks the stored checksum, which means reading the whole file
+	bool verify() const {
+		return checksum(data() + hdr.codes_offset, hdr.slots_offset + hdr.num_slots*slot_size - hdr.codes_offset) == hdr.checksum;
+	}
+
+	size_t size() const {
+		return hdr.num_states;
+	}
+
+	const_iterator begin() const {
+		return const_iterator(this, npos);
+	}
+
+	const_iterator end() const {
+		return const_iterator(this);
+	}
+
+	query_type query(const String& entry, size_t maxdist = 0) const {
+		query_type matches;
+		query(entry, maxdist, [&](const String& word, size_t dist) {
+			matches.insert(std::make_pair(word, dist));
+		});
+		return matches;
+	}
+
+	// Calls sink(word, dist) for each word within maxdist edits of entry, as trie_mmap::query() does; word is only valid during the call
+	template<typename Sink>
+	void query(const String& entry, size_t maxdist, Sink&& sink) const {
+		search_within<levenshtein_automaton<String>>(entry, maxdist, [&](const levenshtein_automaton<String>& la, uint64_t *states, String& word) {
+			query(npos, la, states, word, maxdist, sink);
+		});
+	}
+
+	const_iterator find(const String& entry) const {
+		if (entry.empty()) {
+			return end();
+		}
+		const_iterator rv(this);
+		rv.path.reserve(entry.size() + 1);
+		rv.path.push_back(npos);
+		for (size_t i=0 ; i<entry.size() ; ++i) {
+			Count t = child(rv.path.back(), entry[i]);
+			if (t == npos) {
+				return end();
+			}
+			rv.path.push_back(t);
+		}
+		if (!terminal(rv.path.back())) {
+			return end();
+		}
+		return rv;
+	}
+
+	traverse_type traverse(typename String::value_type c, size_t n=npos) const {
+		Count t = child(static_cast<Count>(n), c);
+		return traverse_type(t, t != npos && terminal(t));
+	}
+
+	traverse_type traverse_end() const {
+		traverse_type rv(npos, false);
+		return rv;
+	}
+
+	browser browse(size_t n=npos) const {
+		return browser(this, static_cast<Count>(n));
+	}
+};
+}
+
+#endif
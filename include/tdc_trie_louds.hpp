@@ -0,0 +1,715 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+References:
+- Jacobson, Space-efficient static trees and graphs, 1989
+- Delpratt, Rahman, Raman, Engineering the LOUDS succinct tree representation, 2006
+*/
+
+#pragma once
+#ifndef TDC_TRIE_LOUDS_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+#define TDC_TRIE_LOUDS_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+
+#include <tdc_trie_mmap.hpp>
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace tdc {
+
+const uint32_t TRIE_LOUDS_SERIALIZED_REVISION = 10550;
+
+inline unsigned ctz64(uint64_t v) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward64(&i, v);
+	return static_cast<unsigned>(i);
+#else
+	return static_cast<unsigned>(__builtin_ctzll(v));
+#endif
+}
+
+/*
+Bit vector with a rank directory of the ones before each 512 bit block, and a select directory of the block that holds every 512th zero.
+Both directories add 1/16 to the size of the bits. Bits are stored little-endian in 64 bit words, lowest bit first.
+*/
+struct rank_select_builder {
+	static constexpr size_t block_words = 8;
+	static constexpr size_t sample_rate = 512;
+
+	std::vector<uint64_t> words;
+	std::vector<uint32_t> ranks;
+	std::vector<uint32_t> samples;
+	size_t size;
+
+	rank_select_builder() :
+		size(0) {
+	}
+
+	void push_back(bool b) {
+		if ((size & 63) == 0) {
+			words.push_back(0);
+		}
+		if (b) {
+			words.back() |= static_cast<uint64_t>(1) << (size & 63);
+		}
+		++size;
+	}
+
+	// Builds the directories once all bits are in
+	void finish() {
+		size_t nblocks = (words.size() + block_words - 1) / block_words;
+		size_t ones = 0, zeros = 0, next_sample = 0;
+		for (size_t w = 0; w < words.size(); ++w) {
+			if (w % block_words == 0) {
+				ranks.push_back(static_cast<uint32_t>(ones));
+			}
+			size_t bits = std::min(static_cast<size_t>(64), size - w*64);
+			size_t o = popcount64(words[w]);
+			ones += o;
+			zeros += bits - o;
+			for (; next_sample < zeros; next_sample += sample_rate) {
+				samples.push_back(static_cast<uint32_t>(w / block_words));
+			}
+		}
+		ranks.push_back(static_cast<uint32_t>(ones));
+		samples.push_back(static_cast<uint32_t>(nblocks ? nblocks - 1 : 0));
+	}
+};
+
+// Read-only view of the sections written from a rank_select_builder
+struct rank_select {
+	static constexpr size_t block_words = rank_select_builder::block_words;
+	static constexpr size_t sample_rate = rank_select_builder::sample_rate;
+
+	const uint64_t *words;
+	const uint32_t *ranks;
+	const uint32_t *samples;
+
+	rank_select() :
+		words(0),
+		ranks(0),
+		samples(0) {
+	}
+
+	uint64_t word(size_t w) const {
+		return bswap(words[w]);
+	}
+
+	bool operator[](size_t i) const {
+		return (word(i >> 6) >> (i & 63)) & 1;
+	}
+
+	// Number of ones before position i
+	size_t rank1(size_t i) const {
+		size_t b = i / (block_words * 64);
+		size_t rv = bswap(ranks[b]);
+		for (size_t w = b * block_words; w < (i >> 6); ++w) {
+			rv += popcount64(word(w));
+		}
+		if (i & 63) {
+			rv += popcount64(word(i >> 6) & ((static_cast<uint64_t>(1) << (i & 63)) - 1));
+		}
+		return rv;
+	}
+
+	// Position of zero number i, counting from 0
+	size_t select0(size_t i) const {
+		size_t lo = bswap(samples[i / sample_rate]), hi = bswap(samples[i / sample_rate + 1]);
+		while (lo < hi) {
+			size_t mid = (lo + hi + 1) / 2;
+			if (mid * block_words * 64 - bswap(ranks[mid]) <= i) {
+				lo = mid;
+			}
+			else {
+				hi = mid - 1;
+			}
+		}
+		size_t r = i - (lo * block_words * 64 - bswap(ranks[lo]));
+		for (size_t w = lo * block_words; ; ++w) {
+			uint64_t x = ~word(w);
+			size_t z = popcount64(x);
+			if (r < z) {
+				for (; r; --r) {
+					x &= x - 1;
+				}
+				return w*64 + ctz64(x);
+			}
+			r -= z;
+		}
+	}
+
+	// Position of the first zero at or after i; there must be one
+	size_t next0(size_t i) const {
+		size_t w = i >> 6;
+		uint64_t x = ~word(w) >> (i & 63);
+		if (x) {
+			return i + ctz64(x);
+		}
+		for (++w; ; ++w) {
+			x = ~word(w);
+			if (x) {
+				return w*64 + ctz64(x);
+			}
+		}
+	}
+};
+
+/*
+LOUDS layout; all fields are little-endian:
+	"TRLO" magic
+	uint32_t revision
+	uint16_t code unit width
+	uint16_t 0
+	uint32_t number of nodes
+	uint32_t number of LOUDS bits, which is 2 * nodes + 1
+	uint32_t offsets of the LOUDS words, rank directory and select directory
+	uint32_t offsets of the terminal words, rank directory and select directory
+	uint32_t offset of the labels
+	uint32_t checksum() of everything from the LOUDS words to the end of the labels
+Each section starts at a multiple of 8 bytes. The LOUDS bits are 10 for a super root, followed by a 1 for each child and then a 0 for each node in
+breadth-first order. Nodes are numbered in that order, with the root as node 0, so the children of a node are consecutive, and so are their uint16_t labels.
+The terminal bits hold one bit per node. Shared suffixes of a compressed trie are unfolded, so this stores the plain trie, but in about 3.2 bits plus the label per node.
+*/
+struct trie_louds_header {
+	uint32_t revision;
+	uint16_t width;
+	uint32_t num_nodes;
+	uint32_t louds_bits;
+	uint32_t offsets[7];
+	uint32_t checksum;
+
+	static size_t size() {
+		return 4 + sizeof(uint32_t) + 2*sizeof(uint16_t) + 2*sizeof(uint32_t) + 7*sizeof(uint32_t) + sizeof(uint32_t);
+	}
+
+	char *write(char *p) const {
+		memcpy(p, "TRLO", 4);
+		p += 4;
+		p = ::tdc::write(p, revision);
+		p = ::tdc::write(p, width);
+		p = ::tdc::write(p, static_cast<uint16_t>(0));
+		p = ::tdc::write(p, num_nodes);
+		p = ::tdc::write(p, louds_bits);
+		for (auto o : offsets) {
+			p = ::tdc::write(p, o);
+		}
+		p = ::tdc::write(p, checksum);
+		return p;
+	}
+
+	// Parses and validates a header from the first n bytes of p, throwing on anything that does not fit
+	void read(const char *p, size_t n, uint16_t expect_width) {
+		if (n < size() || memcmp(p, "TRLO", 4)) {
+			throw std::runtime_error("LOUDS data did not start with magic byte sequence TRLO");
+		}
+		p += 4;
+		::tdc::read(p, revision);
+		p += sizeof(revision);
+		if (revision != TRIE_LOUDS_SERIALIZED_REVISION) {
+			char _msg[] = "LOUDS expected revision %u but data had revision %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, TRIE_LOUDS_SERIALIZED_REVISION, revision));
+			throw std::runtime_error(msg);
+		}
+		::tdc::read(p, width);
+		p += sizeof(width);
+		if (width != expect_width) {
+			char _msg[] = "LOUDS expected code unit width %u but data had width %u";
+			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
+			msg.resize(sprintf(&msg[0], _msg, expect_width, width));
+			throw std::runtime_error(msg);
+		}
+		p += sizeof(uint16_t);
+		::tdc::read(p, num_nodes);
+		p += sizeof(num_nodes);
+		::tdc::read(p, louds_bits);
+		p += sizeof(louds_bits);
+		for (auto& o : offsets) {
+			::tdc::read(p, o);
+			p += sizeof(o);
+		}
+		::tdc::read(p, checksum);
+
+		bool ok = (num_nodes != 0 && louds_bits == 2 * static_cast<uint64_t>(num_nodes) + 1 && offsets[0] >= size());
+		for (size_t i = 0; ok && i < 7; ++i) {
+			ok = (offsets[i] % 8 == 0) && (i == 0 || offsets[i] >= offsets[i-1]);
+		}
+		if (!ok || static_cast<size_t>(offsets[6]) + num_nodes*sizeof(uint16_t) > n) {
+			throw std::runtime_error("LOUDS section sizes do not match the data; the file is truncated or corrupt");
+		}
+	}
+};
+
+inline bool is_trie_louds(const char *fname) {
+	return has_magic(fname, "TRLO");
+}
+
+inline bool is_trie_louds(const char *p, size_t n) {
+	return has_magic(p, n, "TRLO");
+}
+
+// Lays out a trie as LOUDS bits, terminal bits and labels, unfolding any shared nodes
+template<typename String, typename Count>
+class trie_louds_builder {
+private:
+	typedef trie<String, Count> trie_type;
+
+	rank_select_builder louds;
+	rank_select_builder terminals;
+	std::vector<uint16_t> labels;
+
+	static size_t align(size_t n) {
+		return (n + 7) & ~static_cast<size_t>(7);
+	}
+
+	// Zero fills up to the next multiple of 8 bytes from buf
+	static char *pad(char *buf, char *p) {
+		char *e = buf + align(p - buf);
+		memset(p, 0, e - p);
+		return e;
+	}
+
+	static size_t bits_size(const rank_select_builder& bits) {
+		return align(bits.words.size()*sizeof(uint64_t)) + align(bits.ranks.size()*sizeof(uint32_t)) + align(bits.samples.size()*sizeof(uint32_t));
+	}
+
+	static char *write_bits(char *buf, char *p, const rank_select_builder& bits, uint32_t *offsets) {
+		offsets[0] = static_cast<uint32_t>(p - buf);
+		for (auto w : bits.words) {
+			p = write(p, w);
+		}
+		p = pad(buf, p);
+		offsets[1] = static_cast<uint32_t>(p - buf);
+		for (auto r : bits.ranks) {
+			p = write(p, r);
+		}
+		p = pad(buf, p);
+		offsets[2] = static_cast<uint32_t>(p - buf);
+		for (auto s : bits.samples) {
+			p = write(p, s);
+		}
+		return pad(buf, p);
+	}
+
+public:
+	trie_louds_builder(const trie_type& t) {
+		const typename trie_type::node_container_type& nodes = t.nodes;
+
+		// The queue is the breadth-first order of the unfolded trie, so it grows to one entry per output node
+		std::vector<Count> queue(1, 0);
+		louds.push_back(true);
+		louds.push_back(false);
+		labels.push_back(0);
+		terminals.push_back(nodes[0].terminal);
+		for (size_t i = 0; i < queue.size(); ++i) {
+			for (auto& ch : nodes[queue[i]].children) {
+				if (queue.size() >= std::numeric_limits<uint32_t>::max() / 2) {
+					throw std::runtime_error("LOUDS can hold at most 2^31 nodes");
+				}
+				louds.push_back(true);
+				queue.push_back(ch.second);
+				labels.push_back(static_cast<uint16_t>(ch.first));
+				terminals.push_back(nodes[ch.second].terminal);
+			}
+			louds.push_back(false);
+		}
+		louds.finish();
+		terminals.finish();
+	}
+
+	size_t size() const {
+		return labels.size();
+	}
+
+	size_t serialized_size() const {
+		return align(trie_louds_header::size()) + bits_size(louds) + bits_size(terminals) + labels.size()*sizeof(uint16_t);
+	}
+
+	// Serializes into buf, which must hold serialized_size() bytes
+	void serialize(char *buf) const {
+		trie_louds_header hdr;
+		hdr.revision = TRIE_LOUDS_SERIALIZED_REVISION;
+		hdr.width = sizeof(typename String::value_type);
+		hdr.num_nodes = static_cast<uint32_t>(labels.size());
+		hdr.louds_bits = static_cast<uint32_t>(louds.size);
+
+		char *p = buf + align(trie_louds_header::size());
+		memset(buf, 0, p - buf);
+		p = write_bits(buf, p, louds, hdr.offsets);
+		p = write_bits(buf, p, terminals, hdr.offsets + 3);
+		hdr.offsets[6] = static_cast<uint32_t>(p - buf);
+		for (auto l : labels) {
+			p = write(p, l);
+		}
+
+		hdr.checksum = checksum(buf + hdr.offsets[0], p - buf - hdr.offsets[0]);
+		hdr.write(buf);
+	}
+
+	void serialize(std::ostream& out) const {
+		std::vector<char> buf(serialized_size());
+		serialize(buf.data());
+		out.write(buf.data(), buf.size());
+	}
+};
+
+/*
+Read-only view of a LOUDS trie written by trie_louds_builder, with the same interface as trie_mmap.
+Nodes are identified by their breadth-first number; npos (0) is the root, which is never a child, so as a result it means there was no such node.
+Finding a child is one select on the LOUDS bits, a scan to the end of the node's bits, and a search of the children's labels.
+*/
+template<typename String=u16string, typename Count=uint32_t>
+class trie_louds {
+private:
+	trie_louds_header hdr;
+	trie_mapping map;
+	rank_select louds;
+	rank_select terminals;
+	const uint16_t *labels;
+
+	const char *data() const {
+		return map.data();
+	}
+
+	void load() {
+		hdr.read(data(), map.size(), sizeof(typename String::value_type));
+		louds.words = reinterpret_cast<const uint64_t*>(data() + hdr.offsets[0]);
+		louds.ranks = reinterpret_cast<const uint32_t*>(data() + hdr.offsets[1]);
+		louds.samples = reinterpret_cast<const uint32_t*>(data() + hdr.offsets[2]);
+		terminals.words = reinterpret_cast<const uint64_t*>(data() + hdr.offsets[3]);
+		terminals.ranks = reinterpret_cast<const uint32_t*>(data() + hdr.offsets[4]);
+		terminals.samples = reinterpret_cast<const uint32_t*>(data() + hdr.offsets[5]);
+		labels = reinterpret_cast<const uint16_t*>(data() + hdr.offsets[6]);
+	}
+
+	// The children of node k are nodes first .. first+count-1
+	void children(Count k, Count& first, Count& count) const {
+		size_t b = louds.select0(k);
+		first = static_cast<Count>(b - k);
+		count = static_cast<Count>(louds.next0(b + 1) - b - 1);
+	}
+
+	Count first_child(Count k) const {
+		return static_cast<Count>(louds.select0(k) - k);
+	}
+
+	bool terminal(Count k) const {
+		return terminals[k];
+	}
+
+	typename String::value_type self(Count k) const {
+		return bswap(labels[k]);
+	}
+
+	// Subtrees are contiguous on each level, so this counts level by level instead of visiting every node
+	Count num_terminals(Count k) const {
+		size_t rv = 0;
+		for (size_t l = k, r = k + 1; l < r;) {
+			rv += terminals.rank1(r) - terminals.rank1(l);
+			l = first_child(static_cast<Count>(l));
+			r = first_child(static_cast<Count>(r));
+		}
+		return static_cast<Count>(rv);
+	}
+
+	Count child(Count k, typename String::value_type c) const {
+		Count first = 0, count = 0;
+		children(k, first, count);
+		size_t i = findlabel(labels + first, count, c);
+		return (i == count) ? static_cast<Count>(npos) : static_cast<Count>(first + i);
+	}
+
+	// word holds the labels on the path to k, and state is the automaton's state after them; the states below follow it
+	template<typename Sink>
+	void query(Count k, const levenshtein_automaton<String>& la, uint64_t *state, String& word, size_t maxdist, Sink& sink) const {
+		if (terminal(k)) {
+			size_t dist = la.distance(state);
+			if (dist <= maxdist) {
+				sink(static_cast<const String&>(word), dist);
+			}
+		}
+
+		uint64_t *below = state + la.state_size();
+		Count first = 0, count = 0;
+		children(k, first, count);
+		for (Count c = first; c != first + count; ++c) {
+			typename String::value_type label = self(c);
+			if (la.step(state, below, label)) {
+				word.push_back(label);
+				query(c, la, below, word, maxdist, sink);
+				word.pop_back();
+			}
+		}
+	}
+
+public:
+	class const_iterator {
+	private:
+		friend class trie_louds;
+		const trie_louds *owner;
+		std::vector<Count> path;
+
+		void descend(Count n) {
+			for (;;) {
+				Count first = 0, count = 0;
+				owner->children(n, first, count);
+				if (count == 0) {
+					break;
+				}
+				n = first;
+				path.push_back(n);
+			}
+		}
+
+	public:
+		const_iterator(const trie_louds *owner = 0) :
+		owner(owner)
+		{
+		}
+
+		const_iterator(const trie_louds *owner, Count n) :
+		owner(owner),
+		path(1, n)
+		{
+			if (!owner->terminal(n)) {
+				descend(n);
+			}
+		}
+
+		String operator*() const {
+			String rv;
+			rv.reserve(path.size());
+			for (size_t i = 1; i<path.size(); ++i) {
+				rv += owner->self(path[i]);
+			}
+			return rv;
+		}
+
+		bool operator==(const const_iterator& o) const {
+			return owner == o.owner && path == o.path;
+		}
+
+		bool operator!=(const const_iterator& o) const {
+			return !(*this == o);
+		}
+
+		const_iterator& operator++() {
+			while (!path.empty()) {
+				Count old = path.back();
+				path.pop_back();
+
+				if (path.empty()) {
+					break;
+				}
+
+				Count first = 0, count = 0;
+				owner->children(path.back(), first, count);
+				if (old + 1 < first + count) {
+					path.push_back(old + 1);
+					descend(old + 1);
+					break;
+				}
+				if (owner->terminal(path.back())) {
+					break;
+				}
+			}
+			return *this;
+		}
+	};
+
+	class browser {
+	private:
+		const trie_louds *owner;
+		Count node;
+
+	public:
+		class browser_out {
+		private:
+			const trie_louds *owner;
+			Count node;
+
+		public:
+			browser_out(const trie_louds *owner = 0, Count node = npos) :
+				owner(owner),
+				node(node) {
+			}
+
+			const_iterator begin() const {
+				return const_iterator(owner, node);
+			}
+
+			const_iterator end() const {
+				return const_iterator(owner);
+			}
+		};
+
+		// Walks the children of node; which is the number of the current child
+		class browser_iter {
+		private:
+			const trie_louds *owner;
+			Count node;
+			Count which;
+
+		public:
+			browser_iter(const trie_louds *owner = 0, Count node = npos, Count which = 0) :
+				owner(owner),
+				node(node),
+				which(which) {
+			}
+
+			browser_out values() const {
+				return browser_out(owner, which);
+			}
+
+			std::pair<typename String::value_type, Count> operator*() const {
+				return std::make_pair(owner->self(which), owner->num_terminals(which));
+			}
+
+			bool operator==(const browser_iter& o) {
+				return (owner == o.owner) && (node == o.node) && (which == o.which);
+			}
+
+			bool operator!=(const browser_iter& o) {
+				return !(*this == o);
+			}
+
+			browser_iter& operator++() {
+				++which;
+				return *this;
+			}
+		};
+
+		browser(const trie_louds *owner = 0, Count node = npos) :
+			owner(owner),
+			node(node) {
+		}
+
+		browser_iter begin() const {
+			return browser_iter(owner, node, owner->first_child(node));
+		}
+
+		browser_iter end() const {
+			Count first = 0, count = 0;
+			owner->children(node, first, count);
+			return browser_iter(owner, node, first + count);
+		}
+	};
+
+	friend class const_iterator;
+	friend class browser;
+
+	typedef std::map<String,size_t> query_type;
+	typedef std::pair<size_t,bool> traverse_type;
+	typedef String value_type;
+	enum {
+		npos = static_cast<Count>(0)
+	};
+
+	trie_louds(const char *fname, const map_options& opts = map_options()) :
+		map(fname, opts)
+	{
+		load();
+	}
+
+	// Reads a trie that is already in memory, such as one embedded in the binary or received over the network; buf must outlive this
+	trie_louds(const char *buf, size_t n, const map_options& opts = map_options()) :
+		map(buf, n, opts)
+	{
+		load();
+	}
+
+	// Checks the stored checksum, which means reading the whole file
+	bool verify() const {
+		return checksum(data() + hdr.offsets[0], hdr.offsets[6] + hdr.num_nodes*sizeof(uint16_t) - hdr.offsets[0]) == hdr.checksum;
+	}
+
+	size_t size() const {
+		return hdr.num_nodes;
+	}
+
+	const_iterator begin() const {
+		return const_iterator(this, npos);
+	}
+
+	const_iterator end() const {
+		return const_iterator(this);
+	}
+
+	query_type query(const String& entry, size_t maxdist = 0) const {
+		query_type matches;
+		query(entry, maxdist, [&](const String& word, size_t dist) {
+			matches.insert(std::make_pair(word, dist));
+		});
+		return matches;
+	}
+
+	// Calls sink(word, dist) for each word within maxdist edits of entry, as trie_mmap::query() does; word is only valid during the call
+	template<typename Sink>
+	void query(const String& entry, size_t maxdist, Sink&& sink) const {
+		search_within<levenshtein_automaton<String>>(entry, maxdist, [&](const levenshtein_automaton<String>& la, uint64_t *states, String& word) {
+			query(npos, la, states, word, maxdist, sink);
+		});
+	}
+
+	const_iterator find(const String& entry) const {
+		if (entry.empty()) {
+			return end();
+		}
+		const_iterator rv(this);
+		rv.path.reserve(entry.size() + 1);
+		rv.path.push_back(npos);
+		for (size_t i=0 ; i<entry.size() ; ++i) {
+			Count k = child(rv.path.back(), entry[i]);
+			if (k == npos) {
+				return end();
+			}
+			rv.path.push_back(k);
+		}
+		if (!terminal(rv.path.back())) {
+			return end();
+		}
+		return rv;
+	}
+
+	traverse_type traverse(typename String::value_type c, size_t n=npos) const {
+		Count k = child(static_cast<Count>(n), c);
+		return traverse_type(k, k != npos && terminal(k));
+	}
+
+	traverse_type traverse_end() const {
+		traverse_type rv(npos, false);
+		return rv;
+	}
+
+	browser browse(size_t n=npos) const {
+		return browser(this, static_cast<Count>(n));
+	}
+};
+}
+
+#endif
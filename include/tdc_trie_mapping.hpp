@@ -0,0 +1,411 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef TDC_TRIE_MAPPING_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+#define TDC_TRIE_MAPPING_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
+
+#define BOOST_DATE_TIME_NO_LIB 1
+
+#include <tdc_trie.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#define TDC_TRIE_MMAN 1
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#include <cerrno>
+#elif defined(_WIN32)
+	#include <io.h>
+	#include <fcntl.h>
+#endif
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <thread>
+
+namespace tdc {
+
+namespace bi = ::boost::interprocess;
+
+// How the readers map their file; the defaults leave paging to the kernel
+struct map_options {
+	enum access_type {
+		access_normal,
+		// Lookups jump all over the file, so read-ahead only evicts other pages
+		access_random,
+		// Walks the file front to back, as listing every word does
+		access_sequential,
+	};
+	access_type access;
+	// Faults in the whole file while opening, via MAP_POPULATE where there is one, so the first lookups do not wait on the disk
+	bool populate;
+	// Faults in the whole file on a background thread instead, so lookups can start right away while the cache warms
+	bool warm;
+	// Pins the pages with mlock() so page cache pressure can not evict them; needs a large enough RLIMIT_MEMLOCK
+	bool lock;
+	// Reads the file into anonymous memory backed by huge pages, which cuts TLB misses on large tries.
+	// Uses reserved hugetlbfs pages if there are any, else asks for transparent huge pages.
+	bool hugepages;
+
+	map_options() :
+		access(access_normal),
+		populate(false),
+		warm(false),
+		lock(false),
+		hugepages(false) {
+	}
+};
+
+// Takes the map_options flags out of a tool's arguments, starting from the given defaults
+inline map_options parse_map_options(std::vector<std::string>& args, map_options opts = map_options()) {
+	for (auto it = args.begin(); it != args.end();) {
+		if (*it == "--populate") {
+			opts.populate = true;
+		}
+		else if (*it == "--warm") {
+			opts.warm = true;
+		}
+		else if (*it == "--mlock") {
+			opts.lock = true;
+		}
+		else if (*it == "--hugepages") {
+			opts.hugepages = true;
+		}
+		else if (*it == "--random") {
+			opts.access = map_options::access_random;
+		}
+		else if (*it == "--sequential") {
+			opts.access = map_options::access_sequential;
+		}
+		else {
+			++it;
+			continue;
+		}
+		it = args.erase(it);
+	}
+	return opts;
+}
+
+/*
+Read-only view of a serialized trie, shared by all the readers. The trie can be a mapped file, a caller's buffer, or read from a stream
+or file descriptor into memory owned by the view. Descriptors of regular files, which includes memfd_create() ones, are mapped rather than read.
+With map_options::hugepages the trie is copied, and the view is of the copy.
+*/
+class trie_mapping {
+public:
+	// The file is closed again once it is mapped, since the mapping stays valid without it; a process can then map far more tries than it can hold files open
+	trie_mapping(const char *fname, const map_options& opts = map_options()) :
+		mreg(bi::file_mapping(fname, bi::read_only), bi::read_only, 0, 0, 0, map_flags(opts)),
+		begin(static_cast<const char*>(mreg.get_address())),
+		length(mreg.get_size()),
+		populated(map_flags(opts) != bi::default_map_options)
+	{
+		setup(opts);
+	}
+
+	// Views buf without copying it, so it must outlive this; a buffer that is not 8 byte aligned is copied, since the readers load whole fields
+	trie_mapping(const char *buf, size_t n, const map_options& opts = map_options()) :
+		begin(buf),
+		length(n)
+	{
+		if (reinterpret_cast<uintptr_t>(buf) % sizeof(uint64_t)) {
+			own(buf, n);
+		}
+		setup(opts);
+	}
+
+	// Reads in to the end of the stream, e.g. a pipe or std::cin opened in binary mode
+	trie_mapping(std::istream& in, const map_options& opts = map_options()) {
+		// A seekable stream says how much is left, so the buffer is usually allocated once
+		size_t hint = 0;
+		std::streampos at = in.tellg();
+		if (at != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+			std::streampos end = in.tellg();
+			if (end != std::streampos(-1) && end > at) {
+				hint = static_cast<size_t>(end - at);
+			}
+		}
+		in.clear();
+		if (at != std::streampos(-1)) {
+			in.seekg(at);
+		}
+		std::streambuf *sb = in.rdbuf();
+		slurp([sb](char *p, size_t n) {
+			return static_cast<size_t>(sb->sgetn(p, static_cast<std::streamsize>(n)));
+		}, hint);
+		setup(opts);
+	}
+
+#ifdef TDC_TRIE_MMAN
+	// Maps fd if it is a regular file or memfd, and otherwise reads it to the end; fd is not closed
+	trie_mapping(int fd, const map_options& opts = map_options()) {
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			throw std::runtime_error("Could not stat the trie file descriptor");
+		}
+		if (S_ISREG(st.st_mode) && st.st_size > 0) {
+			int flags = MAP_SHARED;
+	#ifdef MAP_POPULATE
+			if (opts.populate && !opts.hugepages) {
+				flags |= MAP_POPULATE;
+				populated = true;
+			}
+	#endif
+			void *p = mmap(0, static_cast<size_t>(st.st_size), PROT_READ, flags, fd, 0);
+			if (p == MAP_FAILED) {
+				throw std::runtime_error("Could not map the trie file descriptor");
+			}
+			region = p;
+			region_size = static_cast<size_t>(st.st_size);
+			begin = static_cast<const char*>(p);
+			length = region_size;
+		}
+		else {
+			slurp([fd](char *p, size_t n) {
+				for (;;) {
+					ssize_t got = ::read(fd, p, n);
+					if (got < 0 && errno == EINTR) {
+						continue;
+					}
+					if (got < 0) {
+						throw std::runtime_error("Could not read the trie file descriptor");
+					}
+					return static_cast<size_t>(got);
+				}
+			}, 0);
+		}
+		setup(opts);
+	}
+#endif
+
+	trie_mapping(const trie_mapping&) = delete;
+	trie_mapping& operator=(const trie_mapping&) = delete;
+
+	~trie_mapping() {
+		stop = true;
+		if (warmer.joinable()) {
+			warmer.join();
+		}
+		release();
+	}
+
+	const char *data() const {
+		return begin;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+private:
+	bi::mapped_region mreg;
+	const char *begin = 0;
+	size_t length = 0;
+	bool populated = false;
+	// Memory this owns: an mmap()ed descriptor or huge page copy, or a plain copy whose uint64_t elements keep it aligned
+	void *region = 0;
+	size_t region_size = 0;
+	std::vector<uint64_t> owned;
+	std::atomic<bool> stop{false};
+	std::thread warmer;
+
+	static bi::map_options_t map_flags(const map_options& opts) {
+#ifdef MAP_POPULATE
+		if (opts.populate && !opts.hugepages) {
+			return MAP_POPULATE;
+		}
+#endif
+		(void)opts;
+		return bi::default_map_options;
+	}
+
+	void own(const char *p, size_t n) {
+		owned.assign((n + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+		if (n) {
+			std::memcpy(owned.data(), p, n);
+		}
+		begin = reinterpret_cast<const char*>(owned.data());
+		length = n;
+	}
+
+	// Reads straight in to the owned buffer until read_some() returns 0, growing it as needed.
+	// There is always a spare byte past hint, so a correct hint needs no growth to see the end.
+	template<typename Read>
+	void slurp(Read read_some, size_t hint) {
+		owned.assign(std::max(hint, size_t(65536)) / sizeof(uint64_t) + 1, 0);
+		size_t n = 0;
+		for (;;) {
+			size_t room = owned.size() * sizeof(uint64_t) - n;
+			if (room == 0) {
+				owned.resize(owned.size() * 2);
+				continue;
+			}
+			size_t got = read_some(reinterpret_cast<char*>(owned.data()) + n, room);
+			if (got == 0) {
+				break;
+			}
+			n += got;
+		}
+		begin = reinterpret_cast<const char*>(owned.data());
+		length = n;
+	}
+
+	void setup(const map_options& opts) {
+		try {
+			if (opts.hugepages && length) {
+				copy_huge();
+			}
+			else {
+				advise(opts.access);
+				if (opts.populate && !populated) {
+					touch(false);
+				}
+			}
+			if (opts.lock) {
+#ifdef TDC_TRIE_MMAN
+				if (mlock(begin, length) != 0) {
+					throw std::runtime_error("Could not lock the trie in memory; raise the locked memory limit (ulimit -l)");
+				}
+#else
+				throw std::runtime_error("Locking the trie in memory is not supported on this platform");
+#endif
+			}
+		}
+		catch (...) {
+			release();
+			throw;
+		}
+		if (opts.warm && !opts.populate && !opts.hugepages) {
+			warmer = std::thread([this] { touch(true); });
+		}
+	}
+
+	void advise(map_options::access_type access) {
+		// Only hints, so failure is not an error
+		if (mreg.get_address()) {
+			if (access == map_options::access_random) {
+				mreg.advise(bi::mapped_region::advice_random);
+			}
+			else if (access == map_options::access_sequential) {
+				mreg.advise(bi::mapped_region::advice_sequential);
+			}
+		}
+#ifdef TDC_TRIE_MMAN
+		else if (region) {
+			if (access == map_options::access_random) {
+				madvise(region, region_size, MADV_RANDOM);
+			}
+			else if (access == map_options::access_sequential) {
+				madvise(region, region_size, MADV_SEQUENTIAL);
+			}
+		}
+#endif
+	}
+
+	// Reads a byte of every page; the warm-up thread stops early if the mapping is being torn down
+	void touch(bool background) {
+		const size_t page = page_size();
+		volatile char sink = 0;
+		for (size_t i = 0; i < length; i += page) {
+			if (background && stop.load(std::memory_order_relaxed)) {
+				break;
+			}
+			sink = sink ^ begin[i];
+		}
+		(void)sink;
+	}
+
+	void copy_huge() {
+#ifdef TDC_TRIE_MMAN
+		// Huge pages only back whole, aligned 2 MiB runs, so round the size up and align the start by hand
+		const size_t huge = size_t(2) << 20;
+		size_t n = (length + huge - 1) & ~(huge - 1);
+		void *p = MAP_FAILED;
+	#ifdef MAP_HUGETLB
+		p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	#endif
+		size_t at = 0;
+		if (p == MAP_FAILED) {
+			n += huge;
+			p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				throw std::runtime_error("Could not allocate memory for a huge page copy of the trie");
+			}
+			at = (huge - reinterpret_cast<uintptr_t>(p) % huge) % huge;
+	#ifdef MADV_HUGEPAGE
+			madvise(static_cast<char*>(p) + at, n - huge, MADV_HUGEPAGE);
+	#endif
+		}
+		char *to = static_cast<char*>(p) + at;
+		std::memcpy(to, begin, length);
+		if (mprotect(p, n, PROT_READ) != 0) {
+			munmap(p, n);
+			throw std::runtime_error("Could not make the huge page copy of the trie read-only");
+		}
+		// Drop whatever the trie was read from before taking over the copy
+		release();
+		bi::mapped_region().swap(mreg);
+		std::vector<uint64_t>().swap(owned);
+		region = p;
+		region_size = n;
+		begin = to;
+#else
+		throw std::runtime_error("Huge page copies of the trie are not supported on this platform");
+#endif
+	}
+
+	void release() {
+#ifdef TDC_TRIE_MMAN
+		if (region) {
+			munmap(region, region_size);
+			region = 0;
+		}
+#endif
+	}
+};
+
+// Opens the named trie file, or reads the trie from stdin if the name is empty or "-"
+inline std::unique_ptr<trie_mapping> open_trie(const std::string& fname, const map_options& opts = map_options()) {
+	if (fname.empty() || fname == "-") {
+#ifdef TDC_TRIE_MMAN
+		return std::unique_ptr<trie_mapping>(new trie_mapping(STDIN_FILENO, opts));
+#else
+	#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+	#endif
+		return std::unique_ptr<trie_mapping>(new trie_mapping(std::cin, opts));
+#endif
+	}
+	return std::unique_ptr<trie_mapping>(new trie_mapping(fname.c_str(), opts));
+}
+
+}
+
+#endif
@@ -21,47 +21,166 @@
 #ifndef TDC_TRIE_MMAP_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
 #define TDC_TRIE_MMAP_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
 
-#define BOOST_DATE_TIME_NO_LIB 1
-
 #include <tdc_trie.hpp>
-#include <boost/interprocess/file_mapping.hpp>
-#include <boost/interprocess/mapped_region.hpp>
+#include <tdc_trie_mapping.hpp>
+
+#if !defined(BOOST_BIG_ENDIAN) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define TDC_TRIE_SSE2 1
+	#include <emmintrin.h>
+	#ifdef __AVX2__
+		#include <immintrin.h>
+	#endif
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+#endif
 
 #include <stdint.h>
 #include <map>
+#include <queue>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <limits>
 #include <stdexcept>
 
 namespace tdc {
 
-namespace bi = ::boost::interprocess;
+#ifdef TDC_TRIE_SSE2
+inline unsigned ctz(unsigned v) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return static_cast<unsigned>(i);
+#else
+	return static_cast<unsigned>(__builtin_ctz(v));
+#endif
+}
+#endif
+
+// Linear scan for the narrow nodes that make up the bulk of a DAWG; the labels share a cache line with the record header
+template<typename T, typename Y>
+inline size_t findlabel_linear(const T *labels, size_t n, const Y& y) {
+	for (size_t i = 0; i < n; ++i) {
+		if (bswap(labels[i]) == y) {
+			return i;
+		}
+	}
+	return n;
+}
+
+// Branch-free lower bound for wide nodes, where a scan would touch too many cache lines
+template<typename T, typename Y>
+inline size_t findlabel_binary(const T *labels, size_t n, const Y& y) {
+	const T *base = labels;
+	for (size_t len = n; len > 1;) {
+		size_t half = len / 2;
+		base = (bswap(base[half]) < y) ? base + half : base;
+		len -= half;
+	}
+	size_t i = (base - labels) + (bswap(*base) < y);
+	return (i < n && bswap(labels[i]) == y) ? i : n;
+}
+
+// Returns the index of the child labelled y among n sorted child labels, or n if there is none
+template<typename T, typename Y>
+inline size_t findlabel(const T *labels, size_t n, const Y& y) {
+	if (n <= 64) {
+		return findlabel_linear(labels, n, y);
+	}
+	return findlabel_binary(labels, n, y);
+}
 
-template<typename NS, typename T, typename Y>
-inline T findchild(const char *p, const NS& nodes, const T& t, size_t n, const Y& y) {
-	T it, first = t;
-	size_t count = n, step;
+#ifdef TDC_TRIE_SSE2
+// Compares 8 (SSE2) or 16 (AVX2) labels per step. Never loads past the last label; a short tail is covered by an overlapping load ending at it.
+inline size_t findlabel(const uint16_t *labels, size_t n, uint16_t y) {
+	if (n < 8) {
+		return findlabel_linear(labels, n, y);
+	}
+	if (n > 64) {
+		return findlabel_binary(labels, n, y);
+	}
+	size_t i = 0;
+#ifdef __AVX2__
+	__m256i needle16 = _mm256_set1_epi16(static_cast<short>(y));
+	for (; i + 16 <= n; i += 16) {
+		unsigned m = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(labels + i)), needle16)));
+		if (m) {
+			return i + ctz(m) / 2;
+		}
+	}
+#endif
+	__m128i needle = _mm_set1_epi16(static_cast<short>(y));
+	for (; i + 8 <= n; i += 8) {
+		unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i)), needle)));
+		if (m) {
+			return i + ctz(m) / 2;
+		}
+	}
+	if (i < n) {
+		i = n - 8;
+		unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i)), needle)));
+		if (m) {
+			return i + ctz(m) / 2;
+		}
+	}
+	return n;
+}
 
-	while (count > 0) {
-		it = first;
-		step = count / 2;
-		it += step;
-		if (nodes[bswap(*it)].self(p) < y) {
-			first = ++it;
-			count -= step + 1;
+// Scans all n byte labels, 16 (SSE2) or 32 (AVX2) per step, so it also works for labels that are not sorted, such as symbol ids
+inline size_t findbyte(const uint8_t *labels, size_t n, uint8_t y) {
+	if (n < 16) {
+		return findlabel_linear(labels, n, y);
+	}
+	size_t i = 0;
+#ifdef __AVX2__
+	__m256i needle32 = _mm256_set1_epi8(static_cast<char>(y));
+	for (; i + 32 <= n; i += 32) {
+		unsigned m = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(labels + i)), needle32)));
+		if (m) {
+			return i + ctz(m);
 		}
-		else {
-			count = step;
+	}
+#endif
+	__m128i needle = _mm_set1_epi8(static_cast<char>(y));
+	for (; i + 16 <= n; i += 16) {
+		unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i)), needle)));
+		if (m) {
+			return i + ctz(m);
 		}
 	}
-	if (first != t + n && nodes[bswap(*first)].self(p) != y) {
-		first = t + n;
+	if (i < n) {
+		i = n - 16;
+		unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i)), needle)));
+		if (m) {
+			return i + ctz(m);
+		}
 	}
-	return first;
+	return n;
+}
+
+// Byte labels, as in UTF-8 tries
+inline size_t findlabel(const uint8_t *labels, size_t n, uint8_t y) {
+	if (n > 128) {
+		return findlabel_binary(labels, n, y);
+	}
+	return findbyte(labels, n, y);
+}
+#else
+inline size_t findbyte(const uint8_t *labels, size_t n, uint8_t y) {
+	return findlabel_linear(labels, n, y);
 }
+#endif
 
+/*
+Read-only view of a serialized trie. Nodes are identified by the file offset of their record, and child slots hold such offsets,
+so each step down the trie is a single load. The node numbers used by trie are not needed, so the trailing index is never read.
+npos (0) is never a valid record offset; as an argument it means the root, and as a result it means there was no such node.
+String picks the code unit width, which must match the file: u16string for UTF-16 tries, or u8string for UTF-8 tries with byte labels.
+If the file has a symbol table, labels in the records are 8 bit symbol ids instead of code units. Input is mapped to ids once per character,
+so the per-node code compares keys, which are ids or code units as stored, and only self() and label_at() turn them back into code units.
+*/
 template<typename String=u16string, typename Count=uint32_t>
 class trie_mmap {
 private:
@@ -69,99 +188,261 @@ private:
 	class trie_node {
 	public:
 		typedef trie_node node_type;
-		typedef const Count* children_type;
-		typedef std::vector<const node_type*> query_path_type;
 		typedef std::map<String,size_t> query_type;
 		typedef trie_mmap root_type;
+		typedef typename String::value_type unit_type;
 
+		const trie_mmap *owner;
 		Count n;
 
+		uint16_t flags(const char *p) const {
+			return bswap(*reinterpret_cast<const uint16_t*>(p + n + sizeof(uint16_t)));
+		}
+
+		// Offset of the next chain entry if this node is part of a path-compressed chain and has more below it, else 0.
+		// A record's flags always have 0x8000 set, while a chain entry holds the number of entries left after it.
+		Count chained(const char *p) const {
+			uint16_t f = flags(p);
+			if (f & 0x8000) {
+				return (f & 0x0002) ? static_cast<Count>(n + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count)) : 0;
+			}
+			return f ? static_cast<Count>(n + sizeof(uint16_t) + sizeof(uint16_t)) : 0;
+		}
+
+		// Offset of the child count; for both plain records and the last chain entry it follows a Count of terminals and the record's weights and value
+		Count block() const {
+			return static_cast<Count>(n + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + owner->extras_size);
+		}
+
+		// Offset of the weights and value of the record this node is in, which follow the Count of terminals that comes last in the record
+		Count extras(const char *p) const {
+			uint16_t f = flags(p);
+			Count at = n;
+			if (f & 0x8000) {
+				if (!(f & 0x0002)) {
+					return static_cast<Count>(at + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count));
+				}
+				at = static_cast<Count>(at + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count));
+				f = bswap(*reinterpret_cast<const uint16_t*>(p + at + sizeof(uint16_t)));
+			}
+			return static_cast<Count>(at + (f + 1)*(sizeof(uint16_t) + sizeof(uint16_t)) + sizeof(Count));
+		}
+
+		// Weight of the word ending here; chained nodes are never terminal, so the record's weight is always this node's
+		Count weight(const char *p) const {
+			if (!owner->weighted || !terminal(p)) {
+				return 0;
+			}
+			return bswap(*reinterpret_cast<const Count*>(p + extras(p)));
+		}
+
+		// Largest weight of any word in the subtree, this node's included
+		Count max_weight(const char *p) const {
+			if (!owner->weighted) {
+				return 0;
+			}
+			Count below = bswap(*reinterpret_cast<const Count*>(p + extras(p) + sizeof(Count)));
+			return std::max(below, weight(p));
+		}
+
+		// File offset of the value of the word ending here, or 0 if there is none
+		Count value(const char *p) const {
+			if (!owner->valued || !terminal(p)) {
+				return 0;
+			}
+			return bswap(*reinterpret_cast<const Count*>(p + extras(p) + (owner->weighted ? 2*sizeof(Count) : 0)));
+		}
+
 		bool terminal(const char *p) const {
-			return *reinterpret_cast<const uint16_t*>(p + n + sizeof(uint16_t)) != 0;
+			return (flags(p) & 0x8001) == 0x8001;
 		}
 
-		typename String::value_type self(const char *p) const {
-			return bswap(*reinterpret_cast<const uint16_t*>(p + n));
+		unit_type key(const char *p) const {
+			return static_cast<unit_type>(bswap(*reinterpret_cast<const uint16_t*>(p + n)));
 		}
 
-		Count num_terminals(const char *p) const {
-			return bswap(*reinterpret_cast<const Count*>(p + n + sizeof(uint16_t) + sizeof(uint16_t)));
+		typename String::value_type self(const char *p) const {
+			return owner->decode(key(p));
 		}
 
-		children_type children(const char *p) const {
-			return reinterpret_cast<children_type>(p + n + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count) + sizeof(Count));
+		Count num_terminals(const char *p) const {
+			uint16_t f = flags(p);
+			size_t at = (f & 0x8000) ? sizeof(uint16_t) + sizeof(uint16_t) : (f + 1)*(sizeof(uint16_t) + sizeof(uint16_t));
+			return bswap(*reinterpret_cast<const Count*>(p + n + at));
 		}
 
 		Count num_children(const char *p) const {
-			return bswap(*reinterpret_cast<const Count*>(p + n + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(Count)));
+			if (chained(p)) {
+				return 1;
+			}
+			return bswap(*reinterpret_cast<const Count*>(p + block()));
 		}
 
-		void buildString(const char *p, const query_path_type& qp, String& in) const {
-			in.reserve(qp.size());
-			for (typename query_path_type::const_iterator it = qp.begin() ; it != qp.end() ; ++it) {
-				in.push_back((*it)->self(p));
+		// Inside a chain the single child's label is the first field of the next entry, which is little-endian, so its first byte is a byte label or symbol id
+		const char *labels(const char *p) const {
+			if (Count next = chained(p)) {
+				return p + next;
 			}
+			return p + block() + sizeof(Count);
 		}
 
-	public:
+		unit_type key_at(const char *p, size_t i) const {
+			if (owner->coded) {
+				return reinterpret_cast<const uint8_t*>(labels(p))[i];
+			}
+			return bswap(reinterpret_cast<const unit_type*>(labels(p))[i]);
+		}
 
-		void query(const root_type& root, const String& entry, size_t pos, query_type& collected, query_path_type& qp, size_t maxdist=0, size_t curdist=0) const {
-			qp.push_back(this);
+		typename String::value_type label_at(const char *p, size_t i) const {
+			return owner->decode(key_at(p, i));
+		}
 
-			const char *p = const_char_p(root.mreg.get_address());
-			auto cs = children(p);
-			auto cn = num_children(p);
+		// Index of the child with key y among c children, or c. Symbol ids are in code unit order rather than sorted, so they are always scanned.
+		size_t find(const char *p, size_t c, unit_type y) const {
+			if (owner->coded) {
+				return findbyte(reinterpret_cast<const uint8_t*>(labels(p)), c, static_cast<uint8_t>(y));
+			}
+			return findlabel(reinterpret_cast<const unit_type*>(labels(p)), c, y);
+		}
 
-			if (pos < entry.size()) {
-				children_type child = findchild(p, root.nodes, cs, cn, entry[pos]);
-				if (child != cs + cn) {
-					root.nodes[bswap(*child)].query(root, entry, pos+1, collected, qp, maxdist, curdist);
-				}
+		Count child_at(const char *p, size_t i) const {
+			if (Count next = chained(p)) {
+				return next;
 			}
+			Count c = bswap(*reinterpret_cast<const Count*>(p + block()));
+			return bswap(reinterpret_cast<const Count*>(p + block() + sizeof(Count) + labels_size(c, owner->width))[i]);
+		}
 
-			if (curdist < maxdist) {
-				for (children_type child = cs ; child != cs + cn ; ++child) {
-					if (pos >= entry.size() || root.nodes[bswap(*child)].self(p) != entry[pos]) {
-						root.nodes[bswap(*child)].query(root, entry, pos, collected, qp, maxdist, curdist+1);
-						root.nodes[bswap(*child)].query(root, entry, pos+1, collected, qp, maxdist, curdist+1);
-					}
-					for (size_t i = 1 ; pos+i < entry.size() ; ++i) {
-						if (root.nodes[bswap(*child)].self(p) == entry[pos + i]) {
-							root.nodes[bswap(*child)].query(root, entry, pos+i+1, collected, qp, maxdist, curdist+i);
-						}
-					}
-				}
+		// Offset of the child with key y, or npos
+		Count child(const char *p, unit_type y) const {
+			if (Count next = chained(p)) {
+				return (static_cast<unit_type>(bswap(*reinterpret_cast<const uint16_t*>(p + next))) == y) ? next : static_cast<Count>(npos);
 			}
+			Count c = bswap(*reinterpret_cast<const Count*>(p + block()));
+			size_t i = find(p, c, y);
+			return (i == c) ? static_cast<Count>(npos) : bswap(reinterpret_cast<const Count*>(p + block() + sizeof(Count) + labels_size(c, owner->width))[i]);
+		}
+
+	public:
 
+		// la is a levenshtein_automaton or levenshtein_rows over keys, see trie_mmap::encode(). word holds the labels on the path to here,
+		// and state is la's state after them; the states below follow it.
+		template<typename Search, typename Sink>
+		void query(const root_type& root, const Search& la, uint64_t *state, String& word, size_t maxdist, Sink& sink) const {
+			const char *p = root.data();
 			if (terminal(p)) {
-				size_t dist = curdist;
-				if (pos < entry.size()) {
-					dist += entry.size() - pos;
-				}
-				else {
-					dist += pos - entry.size();
-				}
+				size_t dist = la.distance(state);
 				if (dist <= maxdist) {
-					String out;
-					buildString(p, qp, out);
-					typename query_type::iterator ins = collected.insert(std::make_pair(out, dist)).first;
-					ins->second = std::min(ins->second, dist);
+					sink(static_cast<const String&>(word), dist);
 				}
 			}
 
-			qp.pop_back();
+			uint64_t *below = state + la.state_size();
+			auto cn = num_children(p);
+			for (size_t child = 0 ; child != cn ; ++child) {
+				if (la.step(state, below, key_at(p, child))) {
+					word.push_back(label_at(p, child));
+					root.node(child_at(p, child)).query(root, la, below, word, maxdist, sink);
+					word.pop_back();
+				}
+			}
 		}
 	};
 
 	friend class trie_node;
 
 	typedef trie_node node_type;
-	typedef std::vector<const node_type*> query_path_type;
 
-	const node_type *nodes;
+	Count root_n;
 	Count num_nodes;
-	bi::file_mapping fmap;
-	bi::mapped_region mreg;
+	trie_header hdr;
+	trie_mapping map;
+	// Set if the records carry weights or values, see trie_header; extras_size is the bytes they take per record
+	bool weighted;
+	bool valued;
+	size_t extras_size;
+	// Set if the file has a symbol table; width is then 1, the size of an id, and symbols and symbol_of map between ids and code units
+	bool coded;
+	size_t width;
+	std::vector<typename String::value_type> symbols;
+	std::vector<uint8_t> symbol_of;
+
+	const char *data() const {
+		return map.data();
+	}
+
+	void load() {
+		hdr.read(data(), map.size(), sizeof(typename String::value_type));
+		num_nodes = hdr.num_nodes;
+		root_n = hdr.nodes_offset;
+		weighted = ((hdr.flags & 0x0002) != 0);
+		valued = ((hdr.flags & 0x0004) != 0);
+		extras_size = (weighted ? 2*sizeof(Count) : 0) + (valued ? sizeof(Count) : 0);
+
+		coded = (hdr.num_symbols != 0);
+		width = coded ? sizeof(uint8_t) : sizeof(typename String::value_type);
+		if (coded) {
+			// Id 0 is the root's non-label, and what encode() gives for code units that are not in the table
+			symbols.resize(256);
+			symbol_of.resize(size_t(1) << (8*sizeof(typename String::value_type)));
+			const uint16_t *table = reinterpret_cast<const uint16_t*>(data() + hdr.symbols_offset);
+			for (size_t i = 0; i < hdr.num_symbols; ++i) {
+				uint16_t u = bswap(table[i]);
+				if (u >= symbol_of.size()) {
+					throw std::runtime_error("Symbol table holds a label wider than the code unit width");
+				}
+				symbols[i + 1] = static_cast<typename String::value_type>(u);
+				symbol_of[u] = static_cast<uint8_t>(i + 1);
+			}
+		}
+	}
+
+	node_type node(Count n) const {
+		node_type rv;
+		rv.owner = this;
+		rv.n = n;
+		return rv;
+	}
+
+	// Key for code unit c as stored in the records; 0 if c is not in the symbol table, which matches no label
+	typename String::value_type encode(typename String::value_type c) const {
+		return coded ? symbol_of[c] : c;
+	}
+
+	String encode(const String& s) const {
+		String rv(s);
+		if (coded) {
+			for (auto& c : rv) {
+				c = symbol_of[c];
+			}
+		}
+		return rv;
+	}
+
+	typename String::value_type decode(typename String::value_type k) const {
+		return coded ? symbols[k] : k;
+	}
+
+	Count resolve(size_t n) const {
+		return (n == npos) ? root_n : static_cast<Count>(n);
+	}
+
+	template<typename Search, typename Sink>
+	void search(const String& entry, size_t maxdist, Sink& sink) const {
+		search_within<Search>(encode(entry), maxdist, [&](const Search& la, uint64_t *states, String& word) {
+			node(root_n).query(*this, la, states, word, maxdist, sink);
+		});
+	}
+
+	template<typename Search>
+	typename node_type::query_type search(const String& entry, size_t maxdist) const {
+		typename node_type::query_type matches;
+		auto sink = [&](const String& word, size_t dist) {
+			matches.insert(std::make_pair(word, dist));
+		};
+		search<Search>(entry, maxdist, sink);
+		return matches;
+	}
 
 public:
 	class const_iterator {
@@ -178,30 +459,33 @@ public:
 
 		const_iterator(const trie_mmap *owner, Count n) :
 		owner(owner),
-		path(1, n)
+		path(1, owner->resolve(n))
 		{
-			const char *p = const_char_p(owner->mreg.get_address());
-			if (owner && n < owner->size() && !owner->nodes[n].terminal(p)) {
-				while (owner->nodes[n].num_children(p)) {
-					n = bswap(*owner->nodes[n].children(p));
+			const char *p = owner->data();
+			n = path.back();
+			if (!owner->node(n).terminal(p)) {
+				while (owner->node(n).num_children(p)) {
+					n = owner->node(n).child_at(p, 0);
 					path.push_back(n);
 				}
 			}
-			if (owner && n == owner->size()) {
-				path.clear();
-			}
 		}
 
 		String operator*() const {
 			String rv;
 			rv.reserve(path.size());
-			const char *p = const_char_p(owner->mreg.get_address());
+			const char *p = owner->data();
 			for (size_t i = 1; i<path.size(); ++i) {
-				rv += owner->nodes[path[i]].self(p);
+				rv += owner->node(path[i]).self(p);
 			}
 			return rv;
 		}
 
+		// Node the current word ends at, as traverse() gives it, so value() and weight() need no second walk
+		size_t node() const {
+			return path.back();
+		}
+
 		bool operator==(const const_iterator& o) const {
 			return owner == o.owner && path == o.path;
 		}
@@ -219,22 +503,22 @@ public:
 					break;
 				}
 
-				const char *p = const_char_p(owner->mreg.get_address());
-				auto cs = owner->nodes[path.back()].children(p);
-				auto cn = owner->nodes[path.back()].num_children(p);
+				const char *p = owner->data();
+				node_type parent = owner->node(path.back());
+				auto cn = parent.num_children(p);
 
-				typename trie_node::children_type child = findchild(p, owner->nodes, cs, cn, owner->nodes[old].self(p));
+				size_t child = parent.find(p, cn, owner->node(old).key(p));
 				++child;
-				if (child != cs + cn) {
-					Count n = bswap(*child);
+				if (child < cn) {
+					Count n = parent.child_at(p, child);
 					path.push_back(n);
-					while (owner->nodes[n].num_children(p)) {
-						n = bswap(*owner->nodes[n].children(p));
+					while (owner->node(n).num_children(p)) {
+						n = owner->node(n).child_at(p, 0);
 						path.push_back(n);
 					}
 					goto plus_return;
 				}
-				if (owner->nodes[path.back()].terminal(p)) {
+				if (owner->node(path.back()).terminal(p)) {
 					break;
 				}
 			}
@@ -283,14 +567,15 @@ public:
 			}
 
 			browser_out values() const {
-				const char *p = const_char_p(owner->mreg.get_address());
-				return browser_out(owner, *(owner->nodes[node].children(p) + which));
+				const char *p = owner->data();
+				return browser_out(owner, owner->node(node).child_at(p, which));
 			}
 
 			std::pair<typename String::value_type, Count> operator*() const {
-				const char *p = const_char_p(owner->mreg.get_address());
-				const typename trie_node::children_type& children = owner->nodes[node].children(p);
-				return std::make_pair(owner->nodes[children[which]].self(p), owner->nodes[children[which]].num_terminals(p));
+				const char *p = owner->data();
+				node_type parent = owner->node(node);
+				node_type child = owner->node(parent.child_at(p, which));
+				return std::make_pair(parent.label_at(p, which), child.num_terminals(p));
 			}
 
 			bool operator==(const browser_iter& o) {
@@ -309,7 +594,7 @@ public:
 
 		browser(const trie_mmap *owner = 0, Count node = npos) :
 			owner(owner),
-			node(node) {
+			node(owner->resolve(node)) {
 		}
 
 		browser_iter begin() const {
@@ -317,8 +602,7 @@ public:
 		}
 
 		browser_iter end() const {
-			const char *p = const_char_p(owner->mreg.get_address());
-			return browser_iter(owner, node, owner->nodes[node].num_children(p));
+			return browser_iter(owner, node, owner->node(node).num_children(owner->data()));
 		}
 	};
 
@@ -331,48 +615,25 @@ public:
 	enum {
 		npos = static_cast<Count>(0)
 	};
+	// What id_of() returns for a string that is not a word
+	static constexpr size_t no_id = std::numeric_limits<size_t>::max();
 
-	trie_mmap(const char *fname) :
-		fmap(fname, bi::read_only),
-		mreg(fmap, bi::read_only)
+	trie_mmap(const char *fname, const map_options& opts = map_options()) :
+		map(fname, opts)
 	{
-		const char *reg = static_cast<const char*>(mreg.get_address());
-		if (memcmp(reg, "TRIE", 4)) {
-			throw std::runtime_error("Unserialize stream did not start with magic byte sequence TRIE");
-		}
-		reg += 4;
-
-		auto rev = read<uint32_t>(reg);
-		if (rev != TRIE_SERIALIZED_REVISION) {
-			char _msg[] = "Unserialize expected revision %u but data had revision %u";
-			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
-			msg.resize(sprintf(&msg[0], _msg, TRIE_SERIALIZED_REVISION, rev));
-			throw std::runtime_error(msg);
-		}
-		reg += sizeof(rev);
-
-		auto s = read<uint16_t>(reg);
-		if (s != sizeof(typename String::value_type)) {
-			char _msg[] = "Unserialize expected code unit width %u but data had width %u";
-			std::string msg(sizeof(_msg) + 11 + 11 + 1, 0);
-			msg.resize(sprintf(&msg[0], _msg, sizeof(typename String::value_type), s));
-			throw std::runtime_error(msg);
-		}
-		reg += sizeof(s);
-		reg += sizeof(s); // Compressed flag
+		load();
+	}
 
-		read(reg, num_nodes);
-		reg += sizeof(num_nodes);
-		for (size_t n = 0; n < num_nodes; ++n) {
-			reg += sizeof(s); // self
-			reg += sizeof(s); // terminal
-			reg += sizeof(Count); // num_terminals
+	// Reads a trie that is already in memory, such as one embedded in the binary or received over the network; buf must outlive this
+	trie_mmap(const char *buf, size_t n, const map_options& opts = map_options()) :
+		map(buf, n, opts)
+	{
+		load();
+	}
 
-			auto c = read<Count>(reg);
-			reg += sizeof(c);
-			reg += c*sizeof(Count); // children
-		}
-		nodes = reinterpret_cast<const node_type*>(reg);
+	// Checks the stored checksum, which means reading the whole file
+	bool verify() const {
+		return checksum(data() + hdr.symbols_offset, hdr.index_offset + hdr.index_size - hdr.symbols_offset) == hdr.checksum;
 	}
 
 	size_t size() const {
@@ -380,7 +641,7 @@ public:
 	}
 
 	const_iterator begin() const {
-		return const_iterator(this, 0);
+		return const_iterator(this, npos);
 	}
 
 	const_iterator end() const {
@@ -388,37 +649,40 @@ public:
 	}
 
 	query_type query(const String& entry, size_t maxdist = 0) const {
-		query_type matches;
-		if (!entry.empty()) {
-			query_path_type qp;
-			qp.reserve(entry.size()+maxdist+2);
-			nodes[0].query(*this, entry, 0, matches, qp, maxdist);
-		}
-		return matches;
+		return search<levenshtein_automaton<String>>(entry, maxdist);
+	}
+
+	/*
+	Calls sink(word, dist) for each word within maxdist edits of entry, in trie order, which is how query() fills its map.
+	word is a buffer that the search reuses, so it is only valid during the call; copy it to keep it. Each word is passed once, with its distance.
+	*/
+	template<typename Sink>
+	void query(const String& entry, size_t maxdist, Sink&& sink) const {
+		search<levenshtein_automaton<String>>(entry, maxdist, sink);
+	}
+
+	// Same results as query(), found by carrying edit distance rows down the trie instead of automaton states; trie-bench times both
+	query_type query_rows(const String& entry, size_t maxdist = 0) const {
+		return search<levenshtein_rows<String>>(entry, maxdist);
 	}
 
 	const_iterator find(const String& entry) const {
 		const_iterator rv = end();
-		const char *p = const_char_p(mreg.get_address());
-		auto cs = nodes[0].children(p);
-		auto cn = nodes[0].num_children(p);
-		typename node_type::children_type child = findchild(p, nodes, cs, cn, entry[0]);
-		if (child != cs + cn) {
+		const char *p = data();
+		Count child = node(root_n).child(p, encode(entry[0]));
+		if (child != npos) {
 			rv.path.clear();
-			rv.path.push_back(0);
-			rv.path.push_back(*child);
+			rv.path.push_back(root_n);
+			rv.path.push_back(child);
 			for (size_t i=1 ; i<entry.size() ; ++i) {
-				Count second = bswap(*child);
-				auto cs = nodes[second].children(p);
-				auto cn = nodes[second].num_children(p);
-				child = findchild(p, nodes, cs, cn, entry[i]);
-				if (child == cs + cn) {
+				child = node(child).child(p, encode(entry[i]));
+				if (child == npos) {
 					rv = end();
 					break;
 				}
-				rv.path.push_back(*child);
+				rv.path.push_back(child);
 			}
-			if (!rv.path.empty() && nodes[rv.path.back()].terminal(p) == false) {
+			if (!rv.path.empty() && node(rv.path.back()).terminal(p) == false) {
 				rv = end();
 			}
 		}
@@ -428,14 +692,11 @@ public:
 	traverse_type traverse(typename String::value_type c, size_t n=npos) const {
 		traverse_type rv(npos, false);
 
-		const char *p = const_char_p(mreg.get_address());
-		auto cs = nodes[n].children(p);
-		auto cn = nodes[n].num_children(p);
-
-		typename node_type::children_type child = findchild(p, nodes, cs, cn, c);
-		if (child != cs + cn) {
-			rv.first = bswap(*child);
-			rv.second = nodes[rv.first].terminal(p);
+		const char *p = data();
+		Count child = node(resolve(n)).child(p, encode(c));
+		if (child != npos) {
+			rv.first = child;
+			rv.second = node(child).terminal(p);
 		}
 
 		return rv;
@@ -446,11 +707,179 @@ public:
 		return rv;
 	}
 
+	// Number of words in the trie, which is the root's num_terminals
+	size_t num_words() const {
+		return node(root_n).num_terminals(data());
+	}
+
+	/*
+	Position of entry among the words sorted by code unit, or no_id if it is not a word. Note that iteration lists a word after the words that extend it.
+	Ids run from 0 to num_words()-1 without gaps, so they serve as a minimal perfect hash into flat arrays of per-word data.
+	Costs one step per code unit plus the num_terminals of the siblings before each step.
+	*/
+	size_t id_of(const String& entry) const {
+		const char *p = data();
+		size_t id = 0;
+		node_type x = node(root_n);
+		for (auto c : entry) {
+			// A word that ends here sorts before all the words that extend it
+			if (x.terminal(p)) {
+				++id;
+			}
+			Count cn = x.num_children(p);
+			size_t i = x.find(p, cn, encode(c));
+			if (i == cn) {
+				return no_id;
+			}
+			for (size_t s = 0; s < i; ++s) {
+				id += node(x.child_at(p, s)).num_terminals(p);
+			}
+			x = node(x.child_at(p, i));
+		}
+		return (!entry.empty() && x.terminal(p)) ? id : no_id;
+	}
+
+	// The word with the given id, see id_of(), or an empty string if id is not below num_words()
+	String word_at(size_t id) const {
+		const char *p = data();
+		String rv;
+		node_type x = node(root_n);
+		if (id >= x.num_terminals(p)) {
+			return rv;
+		}
+		for (;;) {
+			if (x.terminal(p)) {
+				if (id == 0) {
+					return rv;
+				}
+				--id;
+			}
+			Count cn = x.num_children(p);
+			size_t i = 0;
+			for (; i < cn; ++i) {
+				Count nt = node(x.child_at(p, i)).num_terminals(p);
+				if (id < nt) {
+					break;
+				}
+				id -= nt;
+			}
+			if (i == cn) {
+				throw std::runtime_error("Word counts in the trie do not add up; the file is corrupt");
+			}
+			rv.push_back(x.label_at(p, i));
+			x = node(x.child_at(p, i));
+		}
+	}
+
+	// Whether the file stores word weights, see trie::add()
+	bool is_weighted() const {
+		return weighted;
+	}
+
+	// Weight of the word ending at node n as given by traverse(), or 0 if no word ends there or the file has no weights
+	Count weight(size_t n) const {
+		return node(resolve(n)).weight(data());
+	}
+
+	// Whether words can have values, see trie::add()
+	bool has_values() const {
+		return valued;
+	}
+
+	// Value of the word ending at node n as given by traverse(); the view points into the mapping, and has a null data() if the word has no value
+	std::string_view value(size_t n) const {
+		Count at = node(resolve(n)).value(data());
+		if (!at) {
+			return std::string_view();
+		}
+		return std::string_view(data() + at + sizeof(Count), bswap(*reinterpret_cast<const Count*>(data() + at)));
+	}
+
+	// Value of entry as value() gives it, with a null data() if entry is not a word or has no value. Costs the same single walk as find().
+	std::string_view find_value(const String& entry) const {
+		const char *p = data();
+		Count x = root_n;
+		for (auto c : entry) {
+			x = node(x).child(p, encode(c));
+			if (x == npos) {
+				return std::string_view();
+			}
+		}
+		return entry.empty() ? std::string_view() : value(x);
+	}
+
+	/*
+	The k heaviest words that start with prefix, heaviest first, paired with their weights. Subtrees are searched best first by the largest weight
+	stored for them, so a subtree is only expanded while it can still beat the k-th best word found, which costs about k times the word length
+	steps for skewed weights instead of a walk over every completion. Words of equal weight come out in the order the search reaches them.
+	Without stored weights every word weighs 0, and this returns k of the completions.
+	*/
+	std::vector<std::pair<String, Count> > top_k(const String& prefix, size_t k) const {
+		std::vector<std::pair<String, Count> > rv;
+		const char *p = data();
+		Count x = root_n;
+		for (auto c : prefix) {
+			x = node(x).child(p, encode(c));
+			if (x == npos) {
+				return rv;
+			}
+		}
+
+		// A candidate is either a subtree whose bound is the largest weight in it, or a word whose bound is its own weight.
+		// Its labels below the prefix are kept as links into trail, so candidates do not each carry a copy of their string.
+		struct candidate {
+			Count bound;
+			bool word;
+			size_t seq;
+			Count n;
+			size_t trail;
+		};
+		// Heaviest first; on ties words go before subtrees, and the newest candidate first, which makes the search depth first in label order
+		auto lighter = [](const candidate& a, const candidate& b) {
+			if (a.bound != b.bound) {
+				return a.bound < b.bound;
+			}
+			if (a.word != b.word) {
+				return b.word;
+			}
+			return a.seq < b.seq;
+		};
+		const size_t none = std::numeric_limits<size_t>::max();
+		std::vector<std::pair<size_t, typename String::value_type> > trail;
+		std::priority_queue<candidate, std::vector<candidate>, decltype(lighter)> todo(lighter);
+		size_t seq = 0;
+		todo.push(candidate{node(x).max_weight(p), false, seq++, x, none});
+
+		String units;
+		while (!todo.empty() && rv.size() < k) {
+			candidate top = todo.top();
+			todo.pop();
+			if (top.word) {
+				units.clear();
+				for (size_t t = top.trail; t != none; t = trail[t].first) {
+					units.push_back(trail[t].second);
+				}
+				std::reverse(units.begin(), units.end());
+				rv.push_back(std::make_pair(prefix + units, top.bound));
+				continue;
+			}
+			node_type nx = node(top.n);
+			if (nx.terminal(p)) {
+				todo.push(candidate{nx.weight(p), true, seq++, top.n, top.trail});
+			}
+			for (size_t i = nx.num_children(p); i-- > 0;) {
+				Count child = nx.child_at(p, i);
+				trail.push_back(std::make_pair(top.trail, nx.label_at(p, i)));
+				todo.push(candidate{node(child).max_weight(p), false, seq++, child, trail.size() - 1});
+			}
+		}
+		return rv;
+	}
+
 	browser browse(size_t n=npos) const {
 		return browser(this, static_cast<Count>(n));
 	}
 };
-
 }
 
 #endif
@@ -22,6 +22,9 @@
 #define TDC_TRIE_SPELLER_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
 
 #include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
 #include <utf8.h>
 #include <fstream>
 #include <unordered_map>
@@ -31,11 +34,20 @@
 
 namespace tdc {
 
-template<typename String=u16string>
+// Trie can be trie_mmap or trie_da, or anything else with the same find() and query()
+template<typename String=u16string, typename Trie=tdc::trie_mmap<String>>
 class trie_speller {
 public:
-	trie_speller(const std::string& dict) :
-	trie(dict.c_str()),
+	trie_speller(const std::string& dict, const map_options& opts = map_options()) :
+	trie(dict.c_str(), opts),
+	words(8),
+	cw(0)
+	{
+	}
+
+	// Spells against a trie that is already in memory, which must outlive the speller
+	trie_speller(const char *buf, size_t n, const map_options& opts = map_options()) :
+	trie(buf, n, opts),
 	words(8),
 	cw(0)
 	{
@@ -50,7 +62,7 @@ public:
 
 	virtual bool is_correct(const String& word) {
 		size_t ichStart = 0, cchUse = word.size();
-		const uint16_t *pwsz = word.c_str();
+		const typename String::value_type *pwsz = word.c_str();
 
 		// Always test the full given input
 		words[0].u16buffer.resize(0);
@@ -61,7 +73,7 @@ public:
 
 		if (cchUse > 1) {
 			size_t count = cchUse;
-			while (count && (std::iswpunct(pwsz[ichStart+count-1]) || std::iswspace(pwsz[ichStart+count-1]))) {
+			while (count && (unit_ispunct(pwsz[ichStart+count-1]) || unit_isspace(pwsz[ichStart+count-1]))) {
 				--count;
 			}
 			if (count != cchUse) {
@@ -74,7 +86,7 @@ public:
 			}
 
 			size_t start = ichStart, count2 = cchUse;
-			while (start < ichStart+cchUse && (std::iswpunct(pwsz[start]) || std::iswspace(pwsz[start]))) {
+			while (start < ichStart+cchUse && (unit_ispunct(pwsz[start]) || unit_isspace(pwsz[start]))) {
 				++start;
 				--count2;
 			}
@@ -108,7 +120,7 @@ public:
 					// If the word was not valid, fold it to lower case and try again
 					u16buffer.resize(0);
 					u16buffer.reserve(words[i].u16buffer.size());
-					std::transform(words[i].u16buffer.begin(), words[i].u16buffer.end(), std::back_inserter(u16buffer), towlower);
+					fold_lower(words[i].u16buffer, u16buffer);
 					// Don't try again if the lower cased variant has already been tried
 					typename valid_words_t::iterator itl = valid_words.find(u16buffer);
 					if (itl != valid_words.end()) {
@@ -143,34 +155,59 @@ public:
 		std::vector<String> alts;
 
 		if (is_correct(word) != true) {
-			size_t dist = std::max(static_cast<size_t>(1), static_cast<size_t>(std::log(words[cw - 1].u16buffer.size()) / std::log(2)));
-			typename trie_mmap_t::query_type qps[] = { trie.query(words[cw - 1].u16buffer, dist), seen.query(words[cw - 1].u16buffer, dist) };
-			for (size_t i=1 ; i<3 ; ++i) {
-				for (size_t qi = 0; qi < 2; ++qi) {
-					for (typename trie_mmap_t::query_type::iterator it = qps[qi].begin(); it != qps[qi].end(); ++it) {
-						if (it->first == words[cw - 1].u16buffer) {
-							alts.clear();
-							goto find_alternatives_end;
-						}
-						if (it->second == i) {
-							u16buffer.clear();
-							if (cw - 1 != 0) {
-								u16buffer.append(words[0].u16buffer.begin(), words[0].u16buffer.begin() + words[cw - 1].start);
-							}
-							u16buffer.append(it->first);
-							if (cw - 1 != 0) {
-								u16buffer.append(words[0].u16buffer.begin() + words[cw - 1].start + words[cw - 1].count, words[0].u16buffer.end());
-							}
-							if (std::find(alts.begin(), alts.end(), u16buffer) == alts.end()) {
-								alts.push_back(u16buffer);
-							}
-						}
+			const String& wanted = words[cw - 1].u16buffer;
+			// Only words 1 or 2 edits away are suggested, so longer words are not searched any further than that
+			size_t dist = std::max(static_cast<size_t>(1), static_cast<size_t>(std::log(wanted.size()) / std::log(2)));
+			dist = std::min(dist, static_cast<size_t>(2));
+
+			// If the word itself turns up there is nothing to suggest
+			bool exact = false;
+			candidates.clear();
+			candidate_units.clear();
+			auto collect = [&](size_t source) {
+				return [&, source](const String& found, size_t d) {
+					if (d == 0) {
+						exact = true;
+					}
+					else {
+						candidates.push_back(candidate_t{d, source, candidate_units.size(), found.size()});
+						candidate_units.append(found);
 					}
+				};
+			};
+			trie.query(wanted, dist, collect(0));
+			seen.query(wanted, dist, collect(1));
+			if (exact) {
+				return alts;
+			}
+
+			// Closest first, then dictionary before seen words, then in code unit order
+			const typename String::value_type *units = candidate_units.data();
+			std::sort(candidates.begin(), candidates.end(), [units](const candidate_t& a, const candidate_t& b) {
+				if (a.dist != b.dist) {
+					return a.dist < b.dist;
+				}
+				if (a.source != b.source) {
+					return a.source < b.source;
+				}
+				return std::lexicographical_compare(units + a.offset, units + a.offset + a.length, units + b.offset, units + b.offset + b.length);
+			});
+
+			for (const candidate_t& c : candidates) {
+				u16buffer.clear();
+				if (cw - 1 != 0) {
+					u16buffer.append(words[0].u16buffer.begin(), words[0].u16buffer.begin() + words[cw - 1].start);
+				}
+				u16buffer.append(candidate_units, c.offset, c.length);
+				if (cw - 1 != 0) {
+					u16buffer.append(words[0].u16buffer.begin() + words[cw - 1].start + words[cw - 1].count, words[0].u16buffer.end());
+				}
+				if (std::find(alts.begin(), alts.end(), u16buffer) == alts.end()) {
+					alts.push_back(u16buffer);
 				}
 			}
 		}
 
-	find_alternatives_end:
 		return alts;
 	}
 
@@ -179,7 +216,7 @@ public:
 
 		std::string line8;
 		std::string out8;
-		tdc::u16string line16;
+		String token;
 		bool terse = false;
 		while (std::getline(in, line8)) {
 			while (!line8.empty() && tdc::isspace(line8[line8.size()-1])) {
@@ -220,22 +257,22 @@ public:
 					break;
 				}
 
-				line16.clear();
+				token.clear();
 				if (e == std::string::npos) {
-					utf8::utf8to16(line8.begin()+b, line8.end(), std::back_inserter(line16));
+					from_utf8(line8.begin()+b, line8.end(), token);
 				}
 				else {
-					utf8::utf8to16(line8.begin()+b, line8.begin()+e, std::back_inserter(line16));
+					from_utf8(line8.begin()+b, line8.begin()+e, token);
 				}
 
-				if (is_correct(line16)) {
+				if (is_correct(token)) {
 					if (!terse) {
 						out << "*" << std::endl;
 					}
 					continue;
 				}
 
-				const std::vector<tdc::u16string>& alts = find_alternatives(line16);
+				const std::vector<String>& alts = find_alternatives(token);
 				if (alts.empty()) {
 					out << "# " << line8.substr(b, e-b) << " " << b << std::endl;
 					continue;
@@ -247,7 +284,7 @@ public:
 						out << ", ";
 					}
 					out8.clear();
-					utf8::utf16to8(alts[i].begin(), alts[i].end(), std::back_inserter(out8));
+					to_utf8(alts[i].begin(), alts[i].end(), std::back_inserter(out8));
 					out << out8;
 				}
 				out << std::endl;
@@ -261,7 +298,7 @@ public:
 	}
 
 protected:
-	typedef tdc::trie_mmap<String> trie_mmap_t;
+	typedef Trie trie_mmap_t;
 	typedef tdc::trie<String> trie_t;
 	trie_mmap_t trie;
 	trie_t seen;
@@ -288,6 +325,14 @@ protected:
 	String u16buffer;
 	std::string cbuffer;
 
+	// A suggestion found by query(), as a slice of candidate_units; source is 0 for the dictionary and 1 for seen words.
+	// Both buffers are reused between misspellings, so finding suggestions only allocates for the ones that are returned.
+	struct candidate_t {
+		size_t dist, source, offset, length;
+	};
+	std::vector<candidate_t> candidates;
+	String candidate_units;
+
 	size_t cw;
 };
 
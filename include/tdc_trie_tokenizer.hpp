@@ -22,6 +22,9 @@
 #define TDC_TRIE_TOKENIZER_HPP_f28c53c53a48d38efafee7fb7004a01faaac9e22
 
 #include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
 #include <utf8.h>
 #include <fstream>
 #include <vector>
@@ -34,13 +37,14 @@
 
 namespace tdc {
 
-template<typename String = u16string>
+// Trie can be trie_mmap or trie_da, or anything else with the same traverse()
+template<typename String = u16string, typename Trie = ::tdc::trie_mmap<String>>
 class trie_tokenizer {
 private:
-	typedef ::tdc::trie_mmap<String> trie_t;
+	typedef Trie trie_t;
 	const trie_t *trie_;
 	std::string line8;
-	u16string line16;
+	String line;
 
 	typedef std::pair<size_t, size_t> token_t;
 	std::vector<token_t> tokens;
@@ -112,7 +116,7 @@ public:
 			(*out) << "INPUT: ";
 		}
 		void span_print(typename String::iterator begin, typename String::iterator end) {
-			utf8::utf16to8(begin, end, std::ostream_iterator<char>(*out));
+			to_utf8(begin, end, std::ostream_iterator<char>(*out));
 			(*out) << std::endl;
 		}
 		void span_close() {
@@ -130,7 +134,7 @@ public:
 			if (garbage) {
 				(*out) << '*';
 			}
-			utf8::utf16to8(begin, end, std::ostream_iterator<char>(*out));
+			to_utf8(begin, end, std::ostream_iterator<char>(*out));
 		}
 	};
 
@@ -181,24 +185,24 @@ public:
 				continue;
 			}
 
-			// Convert UTF-8 to UTF-16
-			line16.clear();
-			utf8::utf8to16(line8.begin(), line8.end(), std::back_inserter(line16));
+			// Convert UTF-8 to the trie's code units, which for a UTF-8 trie is a plain copy
+			line.clear();
+			from_utf8(line8.begin(), line8.end(), line);
 
-			// Now trim the UTF-16 version, just to catch the 1% crazy input that uses Unicode whitespace
+			// Now trim the code units, just to catch the 1% crazy input that uses Unicode whitespace
 			// Trim trailing whitespace
-			while (!line16.empty() && std::iswspace(line16.back())) {
-				line16.resize(line16.size() - 1);
+			while (!line.empty() && unit_isspace(line.back())) {
+				line.resize(line.size() - 1);
 			}
 			// Trim leading whitespace
-			for (size_t i = 0; i < line16.size(); ++i) {
-				if (!std::iswspace(line16[i])) {
-					line16.erase(line16.begin(), line16.begin() + i); // becomes a no-op for i=0
+			for (size_t i = 0; i < line.size(); ++i) {
+				if (!unit_isspace(line[i])) {
+					line.erase(line.begin(), line.begin() + i); // becomes a no-op for i=0
 					break;
 				}
 			}
 			// Don't even try to tokenize empty lines...
-			if (line16.empty()) {
+			if (line.empty()) {
 				continue;
 			}
 
@@ -208,10 +212,10 @@ public:
 			outputs.clear();
 
 			// Find all possible valid tokens
-			for (size_t co = 0; co < line16.size(); ++co) {
+			for (size_t co = 0; co < line.size(); ++co) {
 				typename trie_t::traverse_type trt(trie_t::npos, false);
-				for (size_t ci = co; ci < line16.size(); ++ci) {
-					trt = trie_->traverse(line16[ci], trt.first);
+				for (size_t ci = co; ci < line.size(); ++ci) {
+					trt = trie_->traverse(line[ci], trt.first);
 					if (trt.second == true) {
 						tokens.push_back(std::make_pair(co, ci + 1));
 					}
@@ -224,7 +228,7 @@ public:
 			// Special case where there are no valid tokens
 			if (tokens.empty()) {
 				pout.span_open();
-				pout.span_print(line16.begin(), line16.end());
+				pout.span_print(line.begin(), line.end());
 				pout.span_close();
 				continue;
 			}
@@ -246,7 +250,7 @@ public:
 
 				// Special case where there is invalid input before any found tokens, or between spans of tokens
 				if (lastout < tokens[tmin].first) {
-					_span_oneshot(pout, line16.begin() + lastout, line16.begin() + span.first, true);
+					_span_oneshot(pout, line.begin() + lastout, line.begin() + span.first, true);
 				}
 				lastout = span.second;
 
@@ -272,14 +276,14 @@ public:
 					for (size_t j = 0; j < output.size(); ++j) {
 						// Output any unclaimed characters between previous output and this token as an invalid token
 						if (lastout < tokens[output[j]].first) {
-							_span_oneshot(pout, line16.begin() + lastout, line16.begin() + tokens[output[j]].first, true);
+							_span_oneshot(pout, line.begin() + lastout, line.begin() + tokens[output[j]].first, true);
 						}
-						_span_oneshot(pout, line16.begin() + tokens[output[j]].first, line16.begin() + tokens[output[j]].second);
+						_span_oneshot(pout, line.begin() + tokens[output[j]].first, line.begin() + tokens[output[j]].second);
 						lastout = tokens[output[j]].second;
 					}
 					// Output any unclaimed characters between previous output and the end of the span as an invalid token
 					if (lastout < span.second) {
-						_span_oneshot(pout, line16.begin() + lastout, line16.begin() + span.second, true);
+						_span_oneshot(pout, line.begin() + lastout, line.begin() + span.second, true);
 					}
 					continue;
 				}
@@ -289,7 +293,7 @@ public:
 
 				// Actually output something...
 				pout.span_open();
-				pout.span_print(line16.begin() + span.first, line16.begin() + span.second);
+				pout.span_print(line.begin() + span.first, line.begin() + span.second);
 				for (size_t i = 0; i < outputs.size(); ++i) {
 					const output_t& output = outputs[i].second;
 					// If we've gone beyond reasonable tokenization, bail out...
@@ -301,14 +305,14 @@ public:
 					for (size_t j = 0; j < output.size(); ++j) {
 						// Output any unclaimed characters between previous output and this token as an invalid token
 						if (lastout < tokens[output[j]].first) {
-							pout.token_print(line16.begin() + lastout, line16.begin() + tokens[output[j]].first, true);
+							pout.token_print(line.begin() + lastout, line.begin() + tokens[output[j]].first, true);
 						}
-						pout.token_print(line16.begin() + tokens[output[j]].first, line16.begin() + tokens[output[j]].second);
+						pout.token_print(line.begin() + tokens[output[j]].first, line.begin() + tokens[output[j]].second);
 						lastout = tokens[output[j]].second;
 					}
 					// Output any unclaimed characters between previous output and the end of the span as an invalid token
 					if (lastout < span.second) {
-						pout.token_print(line16.begin() + lastout, line16.begin() + span.second, true);
+						pout.token_print(line.begin() + lastout, line.begin() + span.second, true);
 					}
 					pout.tokens_close();
 				}
@@ -316,8 +320,8 @@ public:
 			}
 
 			// Special case where there is invalid input after any found tokens
-			if (lastout < line16.size()) {
-				_span_oneshot(pout, line16.begin() + lastout, line16.end(), true);
+			if (lastout < line.size()) {
+				_span_oneshot(pout, line.begin() + lastout, line.end(), true);
 			}
 			pout.line_close();
 		}
@@ -0,0 +1,171 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+
+// What main() parsed from the command line
+struct bench_options {
+	// Runs query() at each distance from 1 up to this
+	size_t maxdist;
+	// Number of times the find() pass is repeated; the fastest pass is reported, since the first one also pays for page faults
+	size_t rounds;
+	// Number of words that query() is run on, as fuzzy lookups are far slower than exact ones
+	size_t queries;
+
+	bench_options() :
+		maxdist(1),
+		rounds(5),
+		queries(1000) {
+	}
+};
+
+template<typename F>
+double time_ns(F f) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+template<typename String, typename F>
+void time_queries(const char *name, const std::vector<String>& words, size_t nq, size_t d, F query) {
+	size_t results = 0;
+	double ns = time_ns([&] {
+		for (size_t i = 0; i < nq; ++i) {
+			results += query(words[i], d).size();
+		}
+	});
+	std::cout << name << " distance " << d << ": " << nq << " words, " << results << " results, " << ns / nq / 1000.0 << " us per word" << std::endl;
+}
+
+// Only the default format has a second fuzzy search engine to compare query() with
+template<typename Trie, typename String>
+void time_query_rows(const Trie&, const std::vector<String>&, size_t, size_t) {
+}
+
+template<typename String>
+void time_query_rows(const tdc::trie_mmap<String>& trie, const std::vector<String>& words, size_t nq, size_t d) {
+	time_queries("query_rows", words, nq, d, [&](const String& w, size_t d) { return trie.query_rows(w, d); });
+}
+
+template<typename Trie>
+int bench(const tdc::trie_mapping& map, const std::vector<std::string>& args, const bench_options& bo) {
+	typedef typename Trie::value_type String;
+	Trie trie(map.data(), map.size());
+
+	std::ifstream file;
+	std::istream *in = &std::cin;
+	if (args.size() > 2 && args[2] != "-") {
+		file.open(args[2].c_str(), std::ios::binary);
+		in = &file;
+	}
+	std::vector<String> words;
+	std::string line8;
+	size_t count = 0, lineno = 0;
+	while (tdc::read_query(*in, line8, count, lineno)) {
+		if (line8.empty() || count == 0) {
+			continue;
+		}
+		String word;
+		tdc::from_utf8(line8.begin(), line8.end(), word);
+		words.push_back(word);
+	}
+	if (words.empty()) {
+		std::cerr << "No words to look up" << std::endl;
+		return 1;
+	}
+
+	size_t hits = 0;
+	double best = 0;
+	for (size_t r = 0; r < bo.rounds; ++r) {
+		hits = 0;
+		double ns = time_ns([&] {
+			for (auto& word : words) {
+				hits += (trie.find(word) != trie.end());
+			}
+		});
+		best = (r == 0) ? ns : std::min(best, ns);
+	}
+	std::cout << "find: " << words.size() << " words, " << hits << " found, " << best / words.size() << " ns per word" << std::endl;
+
+	size_t nq = std::min(bo.queries, words.size());
+	for (size_t d = 1; d <= bo.maxdist; ++d) {
+		time_queries("query", words, nq, d, [&](const String& w, size_t d) { return trie.query(w, d); });
+		time_query_rows(trie, words, nq, d);
+	}
+	return 0;
+}
+
+template<typename String>
+int bench_any(const tdc::trie_mapping& map, const std::vector<std::string>& args, const bench_options& bo) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		return bench<tdc::trie_da<String>>(map, args, bo);
+	}
+	if (tdc::is_trie_louds(map.data(), map.size())) {
+		return bench<tdc::trie_louds<String>>(map, args, bo);
+	}
+	if (tdc::is_trie_compact(map.data(), map.size())) {
+		return bench<tdc::trie_compact<String>>(map, args, bo);
+	}
+	return bench<tdc::trie_mmap<String>>(map, args, bo);
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> args(argv, argv+argc);
+	std::cin.sync_with_stdio(false);
+	std::cout.sync_with_stdio(false);
+
+	bench_options bo;
+	for (auto it = args.begin(); it != args.end();) {
+		if (*it == "-d" && it + 1 != args.end()) {
+			bo.maxdist = std::strtoul(it[1].c_str(), 0, 10);
+			it = args.erase(it, it + 2);
+		}
+		else if (*it == "-r" && it + 1 != args.end()) {
+			bo.rounds = std::max(static_cast<size_t>(1), static_cast<size_t>(std::strtoul(it[1].c_str(), 0, 10)));
+			it = args.erase(it, it + 2);
+		}
+		else if (*it == "-n" && it + 1 != args.end()) {
+			bo.queries = std::strtoul(it[1].c_str(), 0, 10);
+			it = args.erase(it, it + 2);
+		}
+		else {
+			++it;
+		}
+	}
+	tdc::map_options mo = tdc::parse_map_options(args);
+	if (args.size() < 2 || args[1] == "-") {
+		std::cerr << "Usage: trie-bench [-d N] [-r N] [-n N] <trie-file> [in-file]" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
+
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		return bench_any<tdc::u8string>(*map, args, bo);
+	}
+	return bench_any<tdc::u16string>(*map, args, bo);
+}
@@ -18,6 +18,9 @@
 */
 
 #include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
 #include <utf8.h>
 #include <iostream>
 #include <fstream>
@@ -25,8 +28,6 @@
 #include <string>
 #include <memory>
 
-typedef tdc::trie_mmap<> trie_t;
-
 inline void appendJSON(std::string& str, char chr) {
 	if (chr == '\n') {
 		str += '\\';
@@ -41,35 +42,85 @@ inline void appendJSON(std::string& str, char chr) {
 	}
 }
 
-inline void appendJSON(std::string& str, uint16_t chr) {
-	if (chr <= 127) {
-		appendJSON(str, static_cast<char>(chr));
+// Appends code units as UTF-8; a broken sequence becomes a replacement character
+template<typename String>
+inline void appendJSON(std::string& str, const String& units) {
+	std::string units8;
+	try {
+		tdc::to_utf8(units.begin(), units.end(), std::back_inserter(units8));
 	}
-	else {
-		try {
-			utf8::utf16to8(&chr, &chr + 1, std::back_inserter(str));
+	catch (utf8::exception&) {
+		units8 = "\xEF\xBF\xBD";
+	}
+	for (auto ch : units8) {
+		appendJSON(str, ch);
+	}
+}
+
+// Whether units hold a whole character, so a UTF-8 lead byte or a UTF-16 high surrogate is never shown on its own
+inline bool is_whole(const tdc::u16string& units) {
+	return units.back() < 0xD800 || units.back() > 0xDBFF;
+}
+
+inline bool is_whole(const tdc::u8string& units) {
+	uint8_t lead = units.front();
+	size_t len = (lead < 0xC0) ? 1 : (lead < 0xE0) ? 2 : (lead < 0xF0) ? 3 : 4;
+	return units.size() >= len;
+}
+
+// Calls f with each character that follows node, and the browser_iter of its last code unit, following multi unit characters down the trie
+template<typename Trie, typename F>
+void browse_chars(const Trie& trie, size_t node, typename Trie::value_type& units, F& f) {
+	auto browser = trie.browse(node);
+	for (auto it = browser.begin(); it != browser.end(); ++it) {
+		auto label = (*it).first;
+		units.push_back(label);
+		if (is_whole(units)) {
+			f(units, it);
 		}
-		catch (utf8::invalid_utf16&) {
-			str += "\xEF\xBF\xBD";
+		else {
+			browse_chars(trie, trie.traverse(label, node).first, units, f);
 		}
+		units.pop_back();
 	}
 }
 
-void trie_browse(const trie_t& trie, std::istream& in, std::ostream& out) {
+// Only weighted tries in the default format can rank completions; the other readers list small subtrees whole and count the rest
+template<typename Trie>
+bool top_completions(const Trie&, const typename Trie::value_type&, std::vector<typename Trie::value_type>&) {
+	return false;
+}
+
+template<typename String>
+bool top_completions(const tdc::trie_mmap<String>& trie, const String& prefix, std::vector<String>& out) {
+	if (!trie.is_weighted()) {
+		return false;
+	}
+	for (auto& hit : trie.top_k(prefix, 5)) {
+		out.push_back(hit.first);
+	}
+	return true;
+}
+
+template<typename Trie>
+void trie_browse(const Trie& trie, std::istream& in, std::ostream& out) {
+	typedef typename Trie::value_type String;
 	std::string line8, char8, buffer8(1, '{');
-	tdc::u16string line16;
+	String line, units;
+	std::vector<String> tops;
 
 	while (std::getline(in, line8)) {
 		std::cerr << line8 << std::endl;
 
 		buffer8.resize(1);
-		line16.clear();
-		utf8::utf8to16(line8.begin(), line8.end(), std::back_inserter(line16));
-		trie_t::traverse_type tt;
-		for (size_t i = 0; i < line16.size(); ++i) {
-			tt = trie.traverse(line16[i], tt.first);
+		line.clear();
+		tdc::from_utf8(line8.begin(), line8.end(), line);
+		typename Trie::traverse_type tt;
+		for (size_t i = 0; i < line.size(); ++i) {
+			tt = trie.traverse(line[i], tt.first);
 			if (tt == trie.traverse_end()) {
 				line8.clear();
+				line.clear();
 				break;
 			}
 		}
@@ -87,28 +138,38 @@ void trie_browse(const trie_t& trie, std::istream& in, std::ostream& out) {
 			buffer8 += "\"], ";
 		}
 
-		auto browser = trie.browse(tt.first);
-		for (auto it = browser.begin(); it != browser.end(); ++it) {
+		auto visit = [&](const String& units, const typename Trie::browser::browser_iter& it) {
 			auto ch = *it;
 			char8.clear();
 			for (auto ch : line8) {
 				appendJSON(char8, ch);
 			}
-			appendJSON(char8, ch.first);
+			appendJSON(char8, units);
 			buffer8 += '"';
 			buffer8 += char8;
 			buffer8 += "\": ";
-			if (ch.second <= 5) {
+			tops.clear();
+			if (top_completions(trie, line + units, tops)) {
+				char8.clear();
+				for (auto& top : tops) {
+					char8 += '"';
+					appendJSON(char8, top);
+					char8 += "\", ";
+				}
+				char8.resize(char8.size() - 2);
+				buffer8 += '[';
+				buffer8 += char8;
+				buffer8 += ']';
+			}
+			else if (ch.second <= 5) {
 				char8.clear();
 				for (auto trail : it.values()) {
 					char8 += '"';
 					for (auto ch : line8) {
 						appendJSON(char8, ch);
 					}
-					appendJSON(char8, ch.first);
-					for (auto ch : trail) {
-						appendJSON(char8, ch);
-					}
+					appendJSON(char8, units);
+					appendJSON(char8, trail);
 					char8 += "\", ";
 				}
 				char8.resize(char8.size() - 2);
@@ -124,31 +185,17 @@ void trie_browse(const trie_t& trie, std::istream& in, std::ostream& out) {
 			}
 			buffer8 += ',';
 			buffer8 += ' ';
-		}
+		};
+		units.clear();
+		browse_chars(trie, tt.first, units, visit);
 		buffer8.resize(buffer8.size()-2);
 		buffer8 += '}';
 		out << buffer8 << std::endl;
 	}
 }
 
-int main(int argc, char *argv[]) {
-	std::vector<std::string> args(argv, argv+argc);
-	std::cin.sync_with_stdio(false);
-	std::cout.sync_with_stdio(false);
-
-	bool daemon = false;
-	for (auto it = args.begin(); it != args.end();) {
-		if (*it == "-d") {
-			daemon = true;
-			it = args.erase(it);
-		}
-		else {
-			++it;
-		}
-	}
-
-	trie_t trie(args[1].c_str());
-
+template<typename Trie>
+void browse(const Trie& trie, const std::vector<std::string>& args, bool daemon) {
 	do {
 		std::unique_ptr<std::ifstream> in_p;
 		std::unique_ptr<std::ofstream> out_p;
@@ -179,3 +226,49 @@ int main(int argc, char *argv[]) {
 		}
 	} while (daemon);
 }
+
+template<typename String>
+void browse_any(const tdc::trie_mapping& map, const std::vector<std::string>& args, bool daemon) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		browse(tdc::trie_da<String>(map.data(), map.size()), args, daemon);
+	}
+	else if (tdc::is_trie_louds(map.data(), map.size())) {
+		browse(tdc::trie_louds<String>(map.data(), map.size()), args, daemon);
+	}
+	else if (tdc::is_trie_compact(map.data(), map.size())) {
+		browse(tdc::trie_compact<String>(map.data(), map.size()), args, daemon);
+	}
+	else {
+		browse(tdc::trie_mmap<String>(map.data(), map.size()), args, daemon);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> args(argv, argv+argc);
+	std::cin.sync_with_stdio(false);
+	std::cout.sync_with_stdio(false);
+
+	bool daemon = false;
+	for (auto it = args.begin(); it != args.end();) {
+		if (*it == "-d") {
+			daemon = true;
+			it = args.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	tdc::map_options mo = tdc::parse_map_options(args);
+	if (args.size() < 2) {
+		std::cerr << "Usage: trie-browse [-d] <trie-file> [in-file] [out-file]" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
+
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		browse_any<tdc::u8string>(*map, args, daemon);
+	}
+	else {
+		browse_any<tdc::u16string>(*map, args, daemon);
+	}
+}
@@ -18,60 +18,641 @@
 */
 
 #include <tdc_trie.hpp>
+#include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
 #include <utf8.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <map>
+#include <queue>
+#include <memory>
+#include <random>
+#include <filesystem>
+#include <cstdio>
+#include <thread>
+#include <exception>
+#include <cstdlib>
 #include <cctype>
+#include <limits>
+#include <algorithm>
 
-typedef tdc::trie<> trie_t;
+/*
+Where the word on an input line ends. With --values that is the first tab, and the word's value is the rest of the line.
+Otherwise a line can end in a tab and a weight, as in "word\t42"; lines without one weigh 0, so plain word lists stay unweighted.
+*/
+inline size_t word_end(const std::string& line8, bool values) {
+	size_t tab = values ? line8.find('\t') : line8.rfind('\t');
+	if (tab == std::string::npos) {
+		return line8.size();
+	}
+	if (!values && (tab + 1 == line8.size() || line8.find_first_not_of("0123456789", tab + 1) != std::string::npos)) {
+		return line8.size();
+	}
+	while (tab > 0 && tdc::isspace(line8[tab-1])) {
+		--tab;
+	}
+	return tab;
+}
+
+// Adds the word that ends at end, see word_end(), along with its weight or value
+template<typename Trie>
+bool add_line(Trie& trie, const std::string& line8, size_t end, bool sorted, bool values, typename Trie::value_type& units) {
+	units.clear();
+	tdc::from_utf8(line8.begin(), line8.begin() + end, units);
+	if (values && end < line8.size()) {
+		std::string value(line8, line8.find('\t', end) + 1);
+		return sorted ? trie.add_sorted(units, 0, value) : trie.add(units, 0, value);
+	}
+	uint32_t weight = 0;
+	if (!values && end < line8.size()) {
+		unsigned long long w = std::strtoull(line8.c_str() + line8.rfind('\t') + 1, 0, 10);
+		weight = static_cast<uint32_t>(std::min(w, static_cast<unsigned long long>(std::numeric_limits<uint32_t>::max())));
+	}
+	return sorted ? trie.add_sorted(units, weight) : trie.add(units, weight);
+}
 
-void build_trie(trie_t& trie, std::istream& input) {
+// Returns true if reading stopped because the trie reached mem bytes, in which case more input remains
+template<typename Trie>
+bool build_trie(Trie& trie, std::istream& input, bool sorted, bool values, size_t mem = 0) {
 	std::string line8;
-	tdc::u16string line16;
+	typename Trie::value_type line;
 	size_t i=0;
 	for ( ; std::getline(input, line8) ; ++i) {
 		while (!line8.empty() && tdc::isspace(line8[line8.size()-1])) {
 			line8.resize(line8.size()-1);
 		}
-		if (line8.empty() || line8[0] == '#') {
+		size_t end = word_end(line8, values);
+		if (end == 0 || line8[0] == '#') {
 			continue;
 		}
 
-		line16.clear();
-		utf8::utf8to16(line8.begin(), line8.end(), std::back_inserter(line16));
-		trie.insert(line16);
+		add_line(trie, line8, end, sorted, values, line);
 
 		if (i % 10000 == 0) {
 			std::cerr << "Inserted word #" << i << " (" << line8 << ")" << std::endl;
 		}
+		// compress() needs about as much again in temporaries, so stop at half the budget
+		if (mem && trie.memory_usage() * 2 >= mem) {
+			std::cerr << "Inserted " << i+1 << " words, run is full" << std::endl;
+			return true;
+		}
 	}
 	std::cerr << "Inserted " << i << " words" << std::endl;
+	return false;
 }
 
-int main(int argc, char *argv[]) {
-	std::vector<std::string> args(argv, argv+argc);
-	std::cin.sync_with_stdio(false);
-	std::cout.sync_with_stdio(false);
+// Serializes straight into a memory mapped output file of the given size, so the output never needs a second copy in memory
+template<typename F>
+void write_mapped(const std::string& fname, size_t size, F serialize) {
+	{
+		std::ofstream out(fname.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out) {
+			throw std::runtime_error("Could not create output file " + fname);
+		}
+	}
+	std::filesystem::resize_file(fname, size);
 
-	trie_t trie;
+	tdc::bi::file_mapping fmap(fname.c_str(), tdc::bi::read_write);
+	tdc::bi::mapped_region mreg(fmap, tdc::bi::read_write, 0, size);
+	serialize(static_cast<char*>(mreg.get_address()));
+	mreg.flush();
+}
 
-	if (args.size() > 1 && args[1] != "-") {
-		std::ifstream in(args[1].c_str(), std::ios::binary);
-		build_trie(trie, in);
+template<typename Trie>
+void write_trie(const Trie& trie, const std::string& fname, const tdc::serialize_options& opts) {
+	write_mapped(fname, trie.serialized_size(opts), [&](char *buf) {
+		trie.serialize(buf, opts);
+	});
+}
+
+// Writes one of the alternative layouts, which are built in memory first; an empty fname means stdout
+template<typename Layout>
+void write_layout(const Layout& layout, const std::string& fname) {
+	if (fname.empty()) {
+		layout.serialize(std::cout);
 	}
 	else {
-		build_trie(trie, std::cin);
+		write_mapped(fname, layout.serialized_size(), [&](char *buf) {
+			layout.serialize(buf);
+		});
+	}
+}
+
+// Enumerates the words of a serialized run in code unit order; const_iterator visits longer words before their prefixes
+template<typename String>
+class run_cursor {
+private:
+	typedef tdc::trie_mmap<String> run_t;
+	struct frame {
+		size_t node;
+		typename run_t::browser::browser_iter it, end;
+	};
+	const run_t *trie;
+	std::vector<frame> stack;
+
+public:
+	String word;
+	uint32_t weight = 0;
+	std::string_view value;
+
+	run_cursor(const run_t& trie) :
+		trie(&trie) {
+		typename run_t::browser br = trie.browse(run_t::npos);
+		stack.push_back(frame{run_t::npos, br.begin(), br.end()});
+	}
+
+	bool next() {
+		while (!stack.empty()) {
+			frame& top = stack.back();
+			if (top.it == top.end) {
+				stack.pop_back();
+				if (!stack.empty()) {
+					word.pop_back();
+				}
+				continue;
+			}
+			typename String::value_type ch = (*top.it).first;
+			++top.it;
+			typename run_t::traverse_type tt = trie->traverse(ch, top.node);
+			typename run_t::browser br = trie->browse(tt.first);
+			word.push_back(ch);
+			stack.push_back(frame{tt.first, br.begin(), br.end()});
+			if (tt.second) {
+				weight = trie->weight(tt.first);
+				value = trie->value(tt.first);
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Stream-merges the sorted word lists of the serialized runs into a trie built with add_sorted()
+template<typename Trie>
+void merge_runs(Trie& trie, const std::vector<std::string>& runs) {
+	typedef typename Trie::value_type String;
+	typedef tdc::trie_mmap<String> run_t;
+	typedef std::pair<String, size_t> head_t;
+
+	std::vector<std::unique_ptr<run_t>> tries;
+	std::vector<run_cursor<String>> cursors;
+	std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+	for (size_t r = 0; r < runs.size(); ++r) {
+		tries.emplace_back(new run_t(runs[r].c_str()));
+		cursors.push_back(run_cursor<String>(*tries.back()));
+	}
+	for (size_t r = 0; r < runs.size(); ++r) {
+		if (cursors[r].next()) {
+			heads.push(std::make_pair(cursors[r].word, r));
+		}
+	}
+
+	size_t i = 0;
+	while (!heads.empty()) {
+		head_t head = heads.top();
+		heads.pop();
+		// A word in several runs is added once per run, which sums its weights, and the value from the last run wins as it would have in one trie
+		const run_cursor<String>& cur = cursors[head.second];
+		bool added = cur.value.data() ? trie.add_sorted(head.first, cur.weight, std::string(cur.value)) : trie.add_sorted(head.first, cur.weight);
+		if (added) {
+			if (i % 100000 == 0) {
+				std::cerr << "Merged word #" << i << std::endl;
+			}
+			++i;
+		}
+		if (cursors[head.second].next()) {
+			heads.push(std::make_pair(cursors[head.second].word, head.second));
+		}
+	}
+	std::cerr << "Merged " << i << " words from " << runs.size() << " runs" << std::endl;
+}
+
+template<typename Trie>
+void build_trie_spill(Trie& trie, std::istream& input, bool values, size_t mem, const std::string& prefix) {
+	std::vector<std::string> runs;
+	for (bool more = true; more;) {
+		more = build_trie(trie, input, false, values, mem);
+		if (!more && runs.empty()) {
+			// Everything fit in one run, so there is nothing to merge
+			return;
+		}
+		if (trie.size() == 1) {
+			break;
+		}
+		trie.compress();
+
+		runs.push_back(prefix + ".run" + std::to_string(runs.size()));
+		std::cerr << "Writing run " << runs.back() << std::endl;
+		write_trie(trie, runs.back(), tdc::serialize_options());
+		trie.clear();
+	}
+
+	try {
+		// Each run being merged holds a file open, so with more runs than that can stay open at once, the oldest are merged in to a run
+		// of their own first. It takes their place at the front, so a word's value still comes from the last run that has it.
+		const size_t max_fanin = 256;
+		for (size_t n = runs.size(); runs.size() > max_fanin; ++n) {
+			std::vector<std::string> batch(runs.begin(), runs.begin() + max_fanin);
+			merge_runs(trie, batch);
+			trie.compress();
+			runs.insert(runs.begin() + max_fanin, prefix + ".run" + std::to_string(n));
+			std::cerr << "Writing run " << runs[max_fanin] << std::endl;
+			write_trie(trie, runs[max_fanin], tdc::serialize_options());
+			trie.clear();
+			for (auto& run : batch) {
+				std::remove(run.c_str());
+			}
+			runs.erase(runs.begin(), runs.begin() + max_fanin);
+		}
+		merge_runs(trie, runs);
+	}
+	catch (...) {
+		for (auto& run : runs) {
+			std::remove(run.c_str());
+		}
+		throw;
+	}
+	for (auto& run : runs) {
+		std::remove(run.c_str());
+	}
+}
+
+// Smallest --mem budget; runs built in less hold only a few words each, so the build would spend its time writing and merging run files
+const size_t min_mem = 16 * 1024;
+
+// Reads a positive byte count with an optional K, M or G suffix in to size; returns false for anything else
+bool parse_size(const std::string& str, size_t& size) {
+	char *end = 0;
+	double v = std::strtod(str.c_str(), &end);
+	if (end == str.c_str() || !(v > 0.0)) {
+		return false;
+	}
+	switch (*end) {
+	case 'k': case 'K':
+		v *= 1024.0;
+		++end;
+		break;
+	case 'm': case 'M':
+		v *= 1024.0 * 1024.0;
+		++end;
+		break;
+	case 'g': case 'G':
+		v *= 1024.0 * 1024.0 * 1024.0;
+		++end;
+		break;
+	}
+	if (*end || !(v < static_cast<double>(std::numeric_limits<size_t>::max()))) {
+		return false;
+	}
+	size = static_cast<size_t>(v);
+	return true;
+}
+
+// The first code unit of a UTF-8 line in the trie's encoding
+inline uint16_t first_unit(const std::string& line8, const tdc::u16string&) {
+	uint32_t cp = utf8::peek_next(line8.begin(), line8.end());
+	return static_cast<uint16_t>(cp > 0xFFFF ? 0xD7C0 + (cp >> 10) : cp);
+}
+
+inline uint16_t first_unit(const std::string& line8, const tdc::u8string&) {
+	return static_cast<uint8_t>(line8[0]);
+}
+
+template<typename Trie>
+void build_trie_sharded(Trie& trie, std::istream& input, bool sorted, bool values, size_t jobs) {
+	typedef typename Trie::value_type String;
+	// Group raw lines by their first code unit; a group must never be split, since stitched parts must have disjoint roots
+	std::map<uint16_t, std::vector<std::string>> groups;
+	std::string line8;
+	size_t i=0;
+	for ( ; std::getline(input, line8) ; ++i) {
+		while (!line8.empty() && tdc::isspace(line8[line8.size()-1])) {
+			line8.resize(line8.size()-1);
+		}
+		if (word_end(line8, values) == 0 || line8[0] == '#') {
+			continue;
+		}
+
+		groups[first_unit(line8, String())].push_back(line8);
+
+		if (i % 100000 == 0) {
+			std::cerr << "Read word #" << i << " (" << line8 << ")" << std::endl;
+		}
+	}
+	std::cerr << "Read " << i << " words" << std::endl;
+
+	// Deterministically spread groups over shards, largest group first onto the least loaded shard
+	std::vector<std::pair<size_t, uint16_t>> sizes;
+	for (auto& group : groups) {
+		sizes.push_back(std::make_pair(group.second.size(), group.first));
+	}
+	std::sort(sizes.begin(), sizes.end(), [](const std::pair<size_t, uint16_t>& a, const std::pair<size_t, uint16_t>& b) {
+		if (a.first != b.first) {
+			return a.first > b.first;
+		}
+		return a.second < b.second;
+	});
+	jobs = std::max(static_cast<size_t>(1), std::min(jobs, sizes.size()));
+	std::vector<std::vector<uint16_t>> shards(jobs);
+	std::vector<size_t> loads(jobs, 0);
+	for (auto& sz : sizes) {
+		size_t least = std::min_element(loads.begin(), loads.end()) - loads.begin();
+		loads[least] += sz.first;
+		shards[least].push_back(sz.second);
+	}
+	// Look the groups up before the threads start, so the workers never touch the map itself.
+	// Taking groups in code unit order keeps each shard's input sorted if the whole input was.
+	std::vector<std::vector<std::vector<std::string>*>> inputs(jobs);
+	for (size_t j = 0; j < jobs; ++j) {
+		std::sort(shards[j].begin(), shards[j].end());
+		for (auto first : shards[j]) {
+			inputs[j].push_back(&groups.find(first)->second);
+		}
+	}
+
+	std::vector<Trie> parts(jobs);
+	std::vector<std::exception_ptr> errors(jobs);
+	std::vector<std::thread> workers;
+	for (size_t j = 0; j < jobs; ++j) {
+		workers.push_back(std::thread([&, j]() {
+			try {
+				String units;
+				for (auto group : inputs[j]) {
+					for (auto& line : *group) {
+						add_line(parts[j], line, word_end(line, values), sorted, values, units);
+					}
+					std::vector<std::string>().swap(*group);
+				}
+				parts[j].compress(false);
+			}
+			catch (...) {
+				errors[j] = std::current_exception();
+			}
+		}));
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	for (size_t j = 0; j < jobs; ++j) {
+		if (errors[j]) {
+			std::rethrow_exception(errors[j]);
+		}
+		std::cerr << "Shard " << j << ": " << loads[j] << " words, " << parts[j].size() << " nodes" << std::endl;
+	}
+
+	trie.stitch(parts);
+}
+
+// Replays a query log of one UTF-8 word per line, optionally followed by a tab and how many times it was queried, and returns the node visit counts
+template<typename Trie>
+std::vector<size_t> replay_profile(const Trie& trie, const std::string& fname) {
+	std::ifstream in(fname.c_str(), std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Could not open query log " + fname);
+	}
+	std::vector<size_t> heat;
+	std::string line8;
+	size_t queries = 0, weight = 0, lineno = 0;
+	while (tdc::read_query(in, line8, weight, lineno)) {
+		if (line8.empty() || weight == 0) {
+			continue;
+		}
+		typename Trie::value_type word;
+		tdc::from_utf8(line8.begin(), line8.end(), word);
+		trie.count_visits(word, heat, weight);
+		queries += weight;
+	}
+	size_t hot = 0;
+	for (auto h : heat) {
+		hot += (h != 0);
+	}
+	std::cerr << "Profile of " << queries << " queries visited " << hot << " of " << trie.size() << " nodes" << std::endl;
+	return heat;
+}
+
+// What main() parsed from the command line
+struct build_options {
+	bool sorted;
+	// Whether the rest of each line after a tab is the word's value rather than a weight
+	bool values;
+	bool utf8;
+	bool double_array;
+	bool louds;
+	bool compact;
+	size_t jobs;
+	size_t mem;
+	// Query log for --layout=profile
+	std::string profile;
+	tdc::serialize_options serialize;
+
+	build_options() :
+		sorted(false),
+		values(false),
+		utf8(false),
+		double_array(false),
+		louds(false),
+		compact(false),
+		jobs(1),
+		mem(0) {
+	}
+};
+
+// String is u16string for a UTF-16 trie, or u8string for a trie of the UTF-8 bytes as given
+template<typename String>
+int build(const std::vector<std::string>& args, const build_options& bo) {
+	tdc::trie<String> trie;
+
+	try {
+		std::ifstream in;
+		std::istream *input = &std::cin;
+		if (args.size() > 1 && args[1] != "-") {
+			in.open(args[1].c_str(), std::ios::binary);
+			input = &in;
+		}
+		if (bo.mem && !bo.sorted) {
+			if (bo.jobs > 1) {
+				std::cerr << "Ignoring -j since --mem builds one run at a time" << std::endl;
+			}
+			std::string prefix;
+			if (args.size() > 2 && args[2] != "-") {
+				prefix = args[2];
+			}
+			else {
+				std::random_device rd;
+				prefix = (std::filesystem::temp_directory_path() / ("trie-build-" + std::to_string(rd()))).string();
+			}
+			build_trie_spill(trie, *input, bo.values, bo.mem, prefix);
+		}
+		else if (bo.jobs > 1) {
+			build_trie_sharded(trie, *input, bo.sorted, bo.values, bo.jobs);
+		}
+		else {
+			build_trie(trie, *input, bo.sorted, bo.values);
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << "Exception caught: " << e.what() << std::endl;
+		return 1;
 	}
 
 	trie.compress();
 
-	if (args.size() > 2 && args[2] != "-") {
-		std::ofstream out(args[2].c_str(), std::ios::binary);
-		trie.serialize(out);
+	try {
+		std::string fname = (args.size() > 2 && args[2] != "-") ? args[2] : "";
+		if ((trie.is_weighted() || trie.has_values()) && (bo.double_array || bo.louds || bo.compact)) {
+			std::cerr << "Ignoring word weights and values since only the default format stores them" << std::endl;
+		}
+		if (bo.double_array) {
+			tdc::trie_da_builder<String, uint32_t> da(trie);
+			std::cerr << "Double-array uses " << da.num_slots() << " slots for " << da.num_transitions() << " transitions" << std::endl;
+			write_layout(da, fname);
+		}
+		else if (bo.louds) {
+			tdc::trie_louds_builder<String, uint32_t> lo(trie);
+			std::cerr << "LOUDS unfolded " << trie.size() << " nodes to " << lo.size() << std::endl;
+			write_layout(lo, fname);
+		}
+		else if (bo.compact) {
+			tdc::trie_compact_builder<String, uint32_t> co(trie);
+			std::cerr << "Compact records take " << co.serialized_size() << " bytes against " << trie.serialized_size(bo.serialize) << std::endl;
+			write_layout(co, fname);
+		}
+		else {
+			tdc::serialize_options so = bo.serialize;
+			if (so.layout == tdc::serialize_options::layout_profile) {
+				so.heat = replay_profile(trie, bo.profile);
+			}
+			if (so.alphabet) {
+				if (size_t syms = trie.alphabet().size()) {
+					std::cerr << "Alphabet has " << syms << " symbols" << std::endl;
+				}
+				else {
+					std::cerr << "Ignoring --alphabet since there are more than 255 distinct labels" << std::endl;
+				}
+			}
+			if (!fname.empty()) {
+				write_trie(trie, fname, so);
+			}
+			else {
+				trie.serialize(std::cout, so);
+			}
+		}
 	}
-	else {
-		trie.serialize(std::cout);
+	catch (std::exception& e) {
+		std::cerr << "Exception caught: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> args(argv, argv+argc);
+	std::cin.sync_with_stdio(false);
+	std::cout.sync_with_stdio(false);
+
+	build_options bo;
+	bool layout_given = false;
+	for (auto it = args.begin(); it != args.end();) {
+		if (*it == "--sorted") {
+			bo.sorted = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--values") {
+			bo.values = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--utf8") {
+			bo.utf8 = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--double-array") {
+			bo.double_array = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--louds") {
+			bo.louds = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--compact") {
+			bo.compact = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--no-index") {
+			bo.serialize.index = false;
+			it = args.erase(it);
+		}
+		else if (*it == "--path-compress") {
+			bo.serialize.path_compress = true;
+			it = args.erase(it);
+		}
+		else if (*it == "--alphabet") {
+			bo.serialize.alphabet = true;
+			it = args.erase(it);
+		}
+		else if (it->compare(0, 9, "--layout=") == 0) {
+			std::string layout = it->substr(9);
+			if (layout == "creation") {
+				bo.serialize.layout = tdc::serialize_options::layout_creation;
+			}
+			else if (layout == "bfs") {
+				bo.serialize.layout = tdc::serialize_options::layout_bfs;
+			}
+			else if (layout == "dfs") {
+				bo.serialize.layout = tdc::serialize_options::layout_dfs;
+			}
+			else if (layout == "clustered") {
+				bo.serialize.layout = tdc::serialize_options::layout_clustered;
+			}
+			else {
+				std::cerr << "Unknown layout " << layout << "; expected creation, bfs, dfs or clustered" << std::endl;
+				return 1;
+			}
+			layout_given = true;
+			it = args.erase(it);
+		}
+		else if (it->compare(0, 10, "--profile=") == 0) {
+			bo.profile = it->substr(10);
+			bo.serialize.layout = tdc::serialize_options::layout_profile;
+			it = args.erase(it);
+		}
+		else if ((*it == "--mem" && it + 1 != args.end()) || it->compare(0, 6, "--mem=") == 0) {
+			bool separate = (*it == "--mem");
+			std::string size = separate ? it[1] : it->substr(6);
+			if (!parse_size(size, bo.mem)) {
+				std::cerr << "Invalid size " << size << " for --mem; expected a positive number with an optional K, M or G suffix" << std::endl;
+				return 1;
+			}
+			if (bo.mem < min_mem) {
+				std::cerr << "--mem " << size << " is too small to hold a run; it must be at least " << min_mem / 1024 << "K" << std::endl;
+				return 1;
+			}
+			it = args.erase(it, it + (separate ? 2 : 1));
+		}
+		else if (*it == "-j" && it + 1 != args.end()) {
+			bo.jobs = std::strtoul(it[1].c_str(), 0, 10);
+			it = args.erase(it, it + 2);
+		}
+		else if (it->size() > 2 && it->compare(0, 2, "-j") == 0) {
+			bo.jobs = std::strtoul(it->c_str() + 2, 0, 10);
+			it = args.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	bo.serialize.jobs = bo.jobs;
+	// --profile picks its own layout, so another one alongside it would be silently dropped
+	if (layout_given && !bo.profile.empty()) {
+		std::cerr << "--layout and --profile cannot be combined; --profile already lays out the nodes" << std::endl;
+		return 1;
+	}
+
+	if (bo.utf8) {
+		return build<tdc::u8string>(args, bo);
 	}
+	return build<tdc::u16string>(args, bo);
 }
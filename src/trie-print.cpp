@@ -18,19 +18,37 @@
 */
 
 #include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
 #include <utf8.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 
-typedef tdc::trie_mmap<> trie_t;
+// Only the default format stores values, which are printed after a tab so the output can be fed back to trie-build --values
+template<typename Trie>
+void print_value(const Trie&, const typename Trie::const_iterator&, std::ostream&) {
+}
+
+// The iterator already stands on the word's node, so the value is read from there rather than by looking the word up again
+template<typename String>
+void print_value(const tdc::trie_mmap<String>& trie, const typename tdc::trie_mmap<String>::const_iterator& it, std::ostream& out) {
+	std::string_view value = trie.value(it.node());
+	if (value.data()) {
+		out << '\t';
+		out.write(value.data(), value.size());
+	}
+}
 
-void trie_print(const trie_t& trie, std::ostream& out) {
+template<typename Trie>
+void trie_print(const Trie& trie, std::ostream& out) {
 	size_t i = 0;
-	for (trie_t::const_iterator it = trie.begin(); it != trie.end(); ++it) {
-		const tdc::u16string& word16 = *it;
-		utf8::utf16to8(word16.begin(), word16.end(), std::ostream_iterator<char>(out));
+	for (typename Trie::const_iterator it = trie.begin(); it != trie.end(); ++it) {
+		const typename Trie::value_type& word = *it;
+		tdc::to_utf8(word.begin(), word.end(), std::ostream_iterator<char>(out));
+		print_value(trie, it, out);
 		out << std::endl;
 
 		if (i % 10000 == 0) {
@@ -41,12 +59,13 @@ void trie_print(const trie_t& trie, std::ostream& out) {
 	std::cerr << "Printed " << i << " words" << std::endl;
 }
 
-int main(int argc, char *argv[]) {
-	std::vector<std::string> args(argv, argv+argc);
-	std::cin.sync_with_stdio(false);
-	std::cout.sync_with_stdio(false);
-
-	trie_t trie(args[1].c_str());
+template<typename Trie>
+int print(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	Trie trie(map.data(), map.size());
+	if (!trie.verify()) {
+		std::cerr << "Checksum mismatch; " << args[1] << " is corrupt" << std::endl;
+		return 1;
+	}
 
 	if (args.size() > 2 && args[2] != "-") {
 		std::ofstream out(args[2].c_str(), std::ios::binary);
@@ -55,4 +74,39 @@ int main(int argc, char *argv[]) {
 	else {
 		trie_print(trie, std::cout);
 	}
+	return 0;
+}
+
+template<typename String>
+int print_any(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		return print<tdc::trie_da<String>>(map, args);
+	}
+	if (tdc::is_trie_louds(map.data(), map.size())) {
+		return print<tdc::trie_louds<String>>(map, args);
+	}
+	if (tdc::is_trie_compact(map.data(), map.size())) {
+		return print<tdc::trie_compact<String>>(map, args);
+	}
+	return print<tdc::trie_mmap<String>>(map, args);
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> args(argv, argv+argc);
+	std::cin.sync_with_stdio(false);
+	std::cout.sync_with_stdio(false);
+
+	// Listing every word reads the default layout mostly front to back
+	tdc::map_options mo;
+	mo.access = tdc::map_options::access_sequential;
+	mo = tdc::parse_map_options(args, mo);
+	if (args.size() < 2) {
+		args.push_back("-");
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
+
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		return print_any<tdc::u8string>(*map, args);
+	}
+	return print_any<tdc::u16string>(*map, args);
 }
@@ -0,0 +1,124 @@
+/*
+* Copyright (C) 2013-2015, Tino Didriksen <mail@tinodidriksen.com>
+*
+* This file is part of trie-tools
+*
+* trie-tools is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* trie-tools is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with trie-tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <tdc_trie_mmap.hpp>
+#include <tdc_trie_da.hpp>
+#include <tdc_trie_louds.hpp>
+#include <tdc_trie_compact.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <string>
+
+// Smallest number of blocks that together take the given share of all visits
+inline size_t covering(const std::unordered_map<size_t, size_t>& blocks, size_t total, double share) {
+	std::vector<size_t> counts;
+	counts.reserve(blocks.size());
+	for (auto& b : blocks) {
+		counts.push_back(b.second);
+	}
+	std::sort(counts.rbegin(), counts.rend());
+	size_t sum = 0, n = 0;
+	while (n < counts.size() && sum < total * share) {
+		sum += counts[n++];
+	}
+	return n;
+}
+
+/*
+Replays a query log the way an exact lookup walks the trie, counting visits per node record, and reports how many cache lines and pages
+the traffic touches; compare layouts by running it on files built with different --layout or --profile settings.
+Nodes are identified by file offset, so this only works on the formats whose nodes are records at byte offsets.
+*/
+template<typename Trie>
+int profile(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	typedef typename Trie::value_type String;
+	Trie trie(map.data(), map.size());
+
+	std::ifstream file;
+	std::istream *in = &std::cin;
+	if (args.size() > 2 && args[2] != "-") {
+		file.open(args[2].c_str(), std::ios::binary);
+		in = &file;
+	}
+
+	std::unordered_map<size_t, size_t> nodes, lines, pages;
+	size_t queries = 0, visits = 0, weight = 0, lineno = 0;
+	std::string line8;
+	while (tdc::read_query(*in, line8, weight, lineno)) {
+		if (line8.empty() || weight == 0) {
+			continue;
+		}
+		String word;
+		tdc::from_utf8(line8.begin(), line8.end(), word);
+		queries += weight;
+
+		typename Trie::traverse_type trt(Trie::npos, false);
+		for (auto c : word) {
+			trt = trie.traverse(c, trt.first);
+			if (trt.first == Trie::npos) {
+				break;
+			}
+			nodes[trt.first] += weight;
+			lines[trt.first / 64] += weight;
+			pages[trt.first / 4096] += weight;
+			visits += weight;
+		}
+	}
+
+	std::cout << "Queries: " << queries << std::endl;
+	std::cout << "Node visits: " << visits << std::endl;
+	std::cout << "Distinct nodes: " << nodes.size() << std::endl;
+	std::cout << "Cache lines: " << lines.size() << " (" << covering(lines, visits, 0.9) << " take 90% of visits, " << covering(lines, visits, 0.99) << " take 99%)" << std::endl;
+	std::cout << "Pages: " << pages.size() << " (" << covering(pages, visits, 0.9) << " take 90% of visits, " << covering(pages, visits, 0.99) << " take 99%)" << std::endl;
+	return 0;
+}
+
+template<typename String>
+int profile_any(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	if (tdc::is_trie_da(map.data(), map.size()) || tdc::is_trie_louds(map.data(), map.size())) {
+		std::cerr << "Only the default and compact formats store nodes at byte offsets that can be profiled" << std::endl;
+		return 1;
+	}
+	if (tdc::is_trie_compact(map.data(), map.size())) {
+		return profile<tdc::trie_compact<String>>(map, args);
+	}
+	return profile<tdc::trie_mmap<String>>(map, args);
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> args(argv, argv+argc);
+	std::cin.sync_with_stdio(false);
+	std::cout.sync_with_stdio(false);
+
+	tdc::map_options mo = tdc::parse_map_options(args);
+	if (args.size() < 2 || args[1] == "-") {
+		std::cerr << "Usage: trie-profile <trie-file> [query-log]" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
+
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		return profile_any<tdc::u8string>(*map, args);
+	}
+	return profile_any<tdc::u16string>(*map, args);
+}
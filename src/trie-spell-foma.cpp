@@ -26,6 +26,7 @@ int main(int argc, char *argv[]) {
 	std::vector<std::string> args(argv, argv+argc);
 	std::cin.sync_with_stdio(false);
 	std::cout.sync_with_stdio(false);
+	tdc::use_unicode_ctype();
 
 	tdc::trie_speller_fst speller("flookup -b -x '%s'", args[1], args[2]);
 
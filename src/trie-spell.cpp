@@ -22,12 +22,46 @@
 #include <vector>
 #include <string>
 
+template<typename String>
+void spell(const tdc::trie_mapping& map) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		tdc::trie_speller<String, tdc::trie_da<String>> speller(map.data(), map.size());
+		speller.ispell_stream_utf8(std::cin, std::cout);
+	}
+	else if (tdc::is_trie_louds(map.data(), map.size())) {
+		tdc::trie_speller<String, tdc::trie_louds<String>> speller(map.data(), map.size());
+		speller.ispell_stream_utf8(std::cin, std::cout);
+	}
+	else if (tdc::is_trie_compact(map.data(), map.size())) {
+		tdc::trie_speller<String, tdc::trie_compact<String>> speller(map.data(), map.size());
+		speller.ispell_stream_utf8(std::cin, std::cout);
+	}
+	else {
+		tdc::trie_speller<String> speller(map.data(), map.size());
+		speller.ispell_stream_utf8(std::cin, std::cout);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	std::vector<std::string> args(argv, argv+argc);
 	std::cin.sync_with_stdio(false);
 	std::cout.sync_with_stdio(false);
+	tdc::use_unicode_ctype();
 
-	tdc::trie_speller<> speller(args[1]);
+	// Suggestions probe the whole trie in no particular order
+	tdc::map_options mo;
+	mo.access = tdc::map_options::access_random;
+	mo = tdc::parse_map_options(args, mo);
+	if (args.size() < 2) {
+		std::cerr << "Usage: trie-spell <trie-file>" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
 
-	speller.ispell_stream_utf8(std::cin, std::cout);
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		spell<tdc::u8string>(*map);
+	}
+	else {
+		spell<tdc::u16string>(*map);
+	}
 }
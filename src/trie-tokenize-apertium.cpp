@@ -20,8 +20,7 @@
 #include <tdc_trie_tokenizer.hpp>
 #include <iostream>
 
-typedef tdc::trie_mmap<> trie_t;
-
+template<typename String>
 class apertium_printer {
 private:
 	std::ostream *out;
@@ -42,8 +41,8 @@ public:
 	void span_open() {
 		(*out) << '^';
 	}
-	void span_print(tdc::u16string::iterator begin, tdc::u16string::iterator end) {
-		utf8::utf16to8(begin, end, std::ostream_iterator<char>(*out));
+	void span_print(typename String::iterator begin, typename String::iterator end) {
+		tdc::to_utf8(begin, end, std::ostream_iterator<char>(*out));
 	}
 	void span_close() {
 		(*out) << "$ ";
@@ -56,7 +55,7 @@ public:
 	void tokens_close() {
 	}
 
-	void token_print(tdc::u16string::iterator begin, tdc::u16string::iterator end, bool garbage = false) {
+	void token_print(typename String::iterator begin, typename String::iterator end, bool garbage = false) {
 		if (!first_token) {
 			(*out) << '+';
 		}
@@ -64,24 +63,56 @@ public:
 		if (garbage) {
 			(*out) << '*';
 		}
-		utf8::utf16to8(begin, end, std::ostream_iterator<char>(*out));
+		tdc::to_utf8(begin, end, std::ostream_iterator<char>(*out));
 	}
 };
 
+template<typename Trie>
+void tokenize(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	Trie trie(map.data(), map.size());
+
+	tdc::trie_tokenizer<typename Trie::value_type, Trie> tokenizer(trie);
+
+	if (args.size() > 2 && args[2] != "-") {
+		std::ifstream in(args[2].c_str(), std::ios::binary);
+		tokenizer.tokenize(in, apertium_printer<typename Trie::value_type>(std::cout));
+	}
+	else {
+		tokenizer.tokenize(std::cin, apertium_printer<typename Trie::value_type>(std::cout));
+	}
+}
+
+template<typename String>
+void tokenize_any(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		tokenize<tdc::trie_da<String>>(map, args);
+	}
+	else if (tdc::is_trie_louds(map.data(), map.size())) {
+		tokenize<tdc::trie_louds<String>>(map, args);
+	}
+	else if (tdc::is_trie_compact(map.data(), map.size())) {
+		tokenize<tdc::trie_compact<String>>(map, args);
+	}
+	else {
+		tokenize<tdc::trie_mmap<String>>(map, args);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	std::vector<std::string> args(argv, argv + argc);
 	std::cin.sync_with_stdio(false);
 	std::cout.sync_with_stdio(false);
 
-	trie_t trie(args[1].c_str());
-
-	tdc::trie_tokenizer<> tokenizer(trie);
+	tdc::map_options mo = tdc::parse_map_options(args);
+	if (args.size() < 2) {
+		args.push_back("-");
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
 
-	if (args.size() > 2 && args[2] != "-") {
-		std::ifstream in(args[2].c_str(), std::ios::binary);
-		tokenizer.tokenize(in, apertium_printer(std::cout));
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		tokenize_any<tdc::u8string>(*map, args);
 	}
 	else {
-		tokenizer.tokenize(std::cin, apertium_printer(std::cout));
+		tokenize_any<tdc::u16string>(*map, args);
 	}
 }
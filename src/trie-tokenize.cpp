@@ -20,22 +20,52 @@
 #include <tdc_trie_tokenizer.hpp>
 #include <iostream>
 
-typedef tdc::trie_mmap<> trie_t;
+template<typename Trie>
+void tokenize(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	Trie trie(map.data(), map.size());
+
+	tdc::trie_tokenizer<typename Trie::value_type, Trie> tokenizer(trie);
+
+	if (args.size() > 2 && args[2] != "-") {
+		std::ifstream in(args[2].c_str(), std::ios::binary);
+		tokenizer.tokenize(in);
+	}
+	else {
+		tokenizer.tokenize(std::cin);
+	}
+}
+
+template<typename String>
+void tokenize_any(const tdc::trie_mapping& map, const std::vector<std::string>& args) {
+	if (tdc::is_trie_da(map.data(), map.size())) {
+		tokenize<tdc::trie_da<String>>(map, args);
+	}
+	else if (tdc::is_trie_louds(map.data(), map.size())) {
+		tokenize<tdc::trie_louds<String>>(map, args);
+	}
+	else if (tdc::is_trie_compact(map.data(), map.size())) {
+		tokenize<tdc::trie_compact<String>>(map, args);
+	}
+	else {
+		tokenize<tdc::trie_mmap<String>>(map, args);
+	}
+}
 
 int main(int argc, char *argv[]) {
 	std::vector<std::string> args(argv, argv + argc);
 	std::cin.sync_with_stdio(false);
 	std::cout.sync_with_stdio(false);
 
-	trie_t trie(args[1].c_str());
-
-	tdc::trie_tokenizer<> tokenizer(trie);
+	tdc::map_options mo = tdc::parse_map_options(args);
+	if (args.size() < 2) {
+		args.push_back("-");
+	}
+	std::unique_ptr<tdc::trie_mapping> map = tdc::open_trie(args[1], mo);
 
-	if (args.size() > 2 && args[2] != "-") {
-		std::ifstream in(args[2].c_str(), std::ios::binary);
-		tokenizer.tokenize(in);
+	if (tdc::code_unit_width(map->data(), map->size()) == 1) {
+		tokenize_any<tdc::u8string>(*map, args);
 	}
 	else {
-		tokenizer.tokenize(std::cin);
+		tokenize_any<tdc::u16string>(*map, args);
 	}
 }